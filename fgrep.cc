@@ -5,96 +5,464 @@
 #include <fstream>
 #include <string>
 #include <queue>
+#include <iterator>
+#include <map>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <iomanip>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
 
 //
 // It's an Aho-Corasick string searching algorithm implimentation.
 //
 
 
+// Bytes which may start a match. In the root state of the automaton
+// any other byte leads back to the root, so the scan skips them. A few
+// distinct first bytes are compared 16 at once with SSE2 (32 with
+// AVX2), more are looked up in a table, and when many bytes start a
+// pattern there is little to skip and nothing is.
+class start_filter {
+public:
+	static constexpr int max_bytes = 8;
+	void add(char c) {
+		if (!starts[0xff & c]) {
+			starts[0xff & c] = true;
+			if (count < max_bytes)
+				bytes[count] = c;
+			++count;
+		}
+	}
+
+	// Skips over one text for a scan. The compared vectors are set up
+	// once. When the first bytes are common the candidates are close
+	// together and the automaton passes the bytes faster than the
+	// filter skips them, with a branch on the root state at each byte:
+	// after a run of short skips the filter is off for a stretch of the
+	// text, up to resume().
+	class skipper {
+	public:
+		skipper(const start_filter& f): f(f) {
+			if (f.count > 64)
+				off_until = ~std::size_t(0);
+#ifdef __SSE2__
+			for(int k=0; k<f.count && k<max_bytes; ++k) {
+				needle[k] = _mm_set1_epi8(f.bytes[k]);
+#ifdef __AVX2__
+				wide[k] = _mm256_set1_epi8(f.bytes[k]);
+#endif
+			}
+#endif
+		}
+		// Position of the first byte at or after j which may start a
+		// match, or size.
+		std::size_t next(const char* data, std::size_t j, std::size_t size) {
+			std::size_t to = find(data, j, size);
+			if (to-j >= min_skip)
+				short_skips = 0;
+			else if (++short_skips == max_short_skips) {
+				short_skips = 0;
+				off_until = to + off_stretch;
+			}
+			return to;
+		}
+		std::size_t resume() const {
+			return off_until;
+		}
+	private:
+		static constexpr std::size_t min_skip = 16;
+		static constexpr int max_short_skips = 8;
+		static constexpr std::size_t off_stretch = 4096;
+
+		std::size_t find(const char* data, std::size_t j, std::size_t size) const {
+#ifdef __SSE2__
+			if (f.count <= max_bytes) {
+#ifdef __AVX2__
+				for(; j+32<=size; j+=32) {
+					__m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data+j));
+					__m256i m = _mm256_cmpeq_epi8(v, wide[0]);
+					for(int k=1; k<f.count; ++k)
+						m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, wide[k]));
+					if (unsigned mask = _mm256_movemask_epi8(m))
+						return j + __builtin_ctz(mask);
+				}
+#endif
+				for(; j+16<=size; j+=16) {
+					__m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data+j));
+					__m128i m = _mm_cmpeq_epi8(v, needle[0]);
+					for(int k=1; k<f.count; ++k)
+						m = _mm_or_si128(m, _mm_cmpeq_epi8(v, needle[k]));
+					if (int mask = _mm_movemask_epi8(m))
+						return j + __builtin_ctz(mask);
+				}
+			}
+#endif
+			while(j<size && !f.starts[0xff & data[j]])
+				++j;
+			return j;
+		}
+
+		const start_filter& f;
+#ifdef __SSE2__
+		__m128i needle[max_bytes];
+#ifdef __AVX2__
+		__m256i wide[max_bytes];
+#endif
+#endif
+		std::size_t off_until = 0;
+		int short_skips = 0;
+	};
+
+	// Whether a filter read from a file is one add() can make: the table
+	// holds only 0 and 1, count is the number of 1s and the bytes
+	// compared are in the table.
+	bool valid() const {
+		std::array<unsigned char,256> raw;
+		std::memcpy(raw.data(), starts.data(), sizeof(raw));
+		int ones = 0;
+		for(unsigned char b: raw) {
+			if (b > 1)
+				return false;
+			ones += b;
+		}
+		if (ones != count)
+			return false;
+		for(int k=0; k<count && k<max_bytes; ++k)
+			if (!raw[0xff & bytes[k]])
+				return false;
+		return true;
+	}
+private:
+	std::array<bool,256> starts{};
+	std::array<char,max_bytes> bytes;
+	int count = 0;
+};
+
 class fgrep {
 public:
 	fgrep(): save_state(0) {
 		std::array<int,256> state;
 		state.fill(-1);
 		goto_states.emplace_back(state);
+		for(int i=0; i<256; ++i)
+			fold[i] = i;
+	}
+	fgrep(const fgrep&) = delete;
+	fgrep& operator=(const fgrep&) = delete;
+	~fgrep() {
+		if (mapped)
+			munmap(mapped, mapped_len);
+	}
+	// Makes the bytes equivalent: in the patterns any of them matches
+	// any other. The trie is built over the smallest byte of a set and
+	// build_failure() gives the others its edges, so the sets can only
+	// be changed before the first pattern is added. Returns false if
+	// the fgrep is not empty.
+	bool equivalent(const std::string& bytes) {
+		if (mapped || view.patterns || pattern_state.size())
+			return false;
+		std::array<bool,256> joined{};
+		std::uint8_t to = 0xff;
+		for(char c: bytes) {
+			joined[fold[0xff & c]] = true;
+			to = std::min(to, fold[0xff & c]);
+		}
+		for(int i=0; i<256; ++i)
+			if (joined[fold[i]])
+				fold[i] = to;
+		return true;
+	}
+
+	// ASCII letters match regardless of case. Returns false if the
+	// fgrep is not empty.
+	bool fold_case() {
+		for(char c='a'; c<='z'; ++c)
+			if (!equivalent({c, char(c-'a'+'A')}))
+				return false;
+		return true;
 	}
+
 	void add(const std::string& w) {
 		if (w.empty())
 			return;
 		int current_state = 0;
 		for(char c: w) {
-			if (goto_states[current_state][0xff&c] == -1) {
+			int i = fold[0xff & c];
+			if (goto_states[current_state][i] == -1) {
 				std::array<int,256> state;
 				state.fill(-1);
 				goto_states.emplace_back(state);
-				goto_states[current_state][0xff&c] = goto_states.size()-1;
+				goto_states[current_state][i] = goto_states.size()-1;
 			}
-			current_state = goto_states[current_state][0xff&c];
-		}
-		if (current_state+1 > output.size()) {
-			output.resize(current_state+1);
+			current_state = goto_states[current_state][i];
 		}
-		patterns.push_back(w);
-		output[current_state].push_back(patterns.size()-1);
+		pool += w;
+		pool_start.push_back(pool.size());
+		pattern_state.push_back(current_state);
+		for(int i=0; i<256; ++i)
+			if (fold[i] == fold[0xff & w[0]])
+				filter.add(i);
+		max_len = std::max(max_len, w.size());
 	}
 
-	void build_failure(void) {
-		if (output.empty())
+	// With compact the automaton is built over byte classes with
+	// narrow state numbers and the trie is freed, search_with_failure()
+	// then runs the automaton too. No patterns can be added after that.
+	void build_failure(bool compact = false) {
+		if (pattern_state.empty())
 			return;
+		for(int i=0; i<256; ++i) {
+			if (fold[i] != i)
+				for(auto& state: goto_states)
+					state[i] = state[fold[i]];
+		}
+		build_outputs();
 		failure.resize(goto_states.size());
 		std::fill(failure.begin(),failure.end(),-1);
 		failure[0] = 0;
+		output_link.assign(goto_states.size(), -1);
 		std::queue<int> bfsq;
-		fsm.resize(goto_states.size(), std::array<int,256>({{}}));
-		for(int i=0; i<256; ++i) {
+		int width = 256;
+		std::array<int,256> column;
+		if (compact) {
+			width = build_classes(column);
+			if (goto_states.size() <= 0x10000)
+				dfa16.resize(goto_states.size()*width);
+			else
+				dfa32.resize(goto_states.size()*width);
+		} else {
+			for(int i=0; i<256; ++i)
+				column[i] = i;
+			fsm.resize(goto_states.size(), std::array<int,256>({{}}));
+		}
+		// Column k of the automaton is the transition by byte column[k].
+		for(int k=0; k<width; ++k) {
+			int i = column[k];
 			if (int next_state = goto_states[0][i] ; next_state !=-1) {
-				failure[next_state] = 0;
-				bfsq.push(next_state);
+				if (fold[i] == i) {
+					failure[next_state] = 0;
+					if (has_own_output(next_state))
+						output_link[next_state] = next_state;
+					bfsq.push(next_state);
+				}
 			} else
 				goto_states[0][i] = 0;
 			
-			fsm[0][i]=goto_states[0][i];
+			set_next(0, k, goto_states[0][i]);
 		}
 
 		while(!bfsq.empty()) {
 			int r = bfsq.front();
 			bfsq.pop();
-			for(int i = 0; i<256; ++i) {
+			for(int k = 0; k<width; ++k) {
+				int i = column[k];
 				if (int next_state = goto_states[r][i]; next_state!=-1) {
-					int state = failure[r];
-					while(goto_states[state][i]==-1)
-						state = failure[state];
-					failure[next_state] = state;
-					bfsq.push(next_state);
-					// If prefix ("state") have output then suffix ("next_state") should have it.
-					// so adding here output of some prefix to suffix.
-					merge_output(state, next_state);
-					fsm[r][i]=goto_states[r][i];
+					// An equivalent byte leads to the same state,
+					// which is done with the byte of the trie.
+					if (fold[i] == i) {
+						int state = failure[r];
+						while(goto_states[state][i]==-1)
+							state = failure[state];
+						state = goto_states[state][i];
+						failure[next_state] = state;
+						bfsq.push(next_state);
+						// Outputs of the suffix ("state") are outputs of
+						// "next_state" too, they are found through the link.
+						output_link[next_state] = has_own_output(next_state) ?
+							next_state : output_link[state];
+					}
+					set_next(r, k, goto_states[r][i]);
 				} else {
-					fsm[r][i]=goto_states[failure[r]][i];
+					// The failure state is closer to the root, so its
+					// row is complete already.
+					set_next(r, k, next(failure[r], k));
 				}
 			}
 		}
+		if (compact)
+			std::vector<std::array<int,256>>().swap(goto_states);
+		view.dfa16 = dfa16.empty() ? nullptr : dfa16.data();
+		view.dfa32 = dfa32.empty() ? nullptr : dfa32.data();
+		view.out_start = out_start.data();
+		view.out_ids = out_ids.data();
+		view.output_link = output_link.data();
+		view.failure = failure.data();
+		view.pool_start = pool_start.data();
+		view.pool = pool.data();
+		view.states = output_link.size();
+		view.patterns = pattern_state.size();
+	}
+
+	// Writes the compact automaton into a file for load(). Returns
+	// false if the automaton is not compact or on a write error.
+	bool save(const std::string& file) const {
+		if (!view.dfa16 && !view.dfa32)
+			return false;
+		file_header h{};
+		std::copy_n(file_magic, sizeof(h.magic), h.magic);
+		h.version = file_version;
+		h.states = view.states;
+		h.classes = classes;
+		h.patterns = view.patterns;
+		h.id_size = view.dfa16 ? sizeof(*view.dfa16) : sizeof(*view.dfa32);
+		h.max_len = max_len;
+		h.pool_len = view.pool_start[view.patterns];
+		h.byte_class = byte_class;
+		h.filter = filter;
+		std::ofstream of(file, std::ios::binary);
+		std::size_t pos = 0;
+		auto put = [&](const void* p, std::size_t n) {
+			static const char zeros[file_align] = {};
+			of.write(static_cast<const char*>(p), n);
+			of.write(zeros, (file_align - (pos+n)%file_align)%file_align);
+			pos = (pos+n+file_align-1)/file_align*file_align;
+		};
+		put(&h, sizeof(h));
+		if (view.dfa16)
+			put(view.dfa16, std::size_t(h.states)*h.classes*h.id_size);
+		else
+			put(view.dfa32, std::size_t(h.states)*h.classes*h.id_size);
+		put(view.out_start, (h.states+1)*sizeof(int));
+		put(view.out_ids, h.patterns*sizeof(int));
+		put(view.output_link, h.states*sizeof(int));
+		put(view.failure, h.states*sizeof(int));
+		put(view.pool_start, (h.patterns+1)*sizeof(std::uint64_t));
+		put(view.pool, h.pool_len);
+		of.close();
+		return bool(of);
+	}
+
+	// Maps a file written by save(): the arrays are used in place, so
+	// processes which load the same file share its pages. Returns false
+	// if the fgrep is not empty, if the file can't be mapped or if it is
+	// not a sound compiled automaton of this version.
+	bool load(const std::string& file) {
+		if (mapped || view.patterns || pattern_state.size())
+			return false;
+		int fd = open(file.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat st;
+		void* addr = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && std::size_t(st.st_size) >= sizeof(file_header))
+			addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (addr == MAP_FAILED)
+			return false;
+		if (!map_tables(static_cast<const char*>(addr), st.st_size)) {
+			munmap(addr, st.st_size);
+			view = tables();
+			return false;
+		}
+		mapped = addr;
+		mapped_len = st.st_size;
+		goto_states.clear();
+		return true;
 	}
 
 
 	std::pair<int,std::list<int>> search_with_fsm(const std::string& text) {
-		if (!output.empty()) {
-			int j = 0;
-			int state = 0;
-			while(j<text.size()) {
-				state = fsm[state][0xff & text[j++]];
-				if(count_output(state)>0) {
-					save_state = state;
-					return std::make_pair(j-1, output_strings(state));
-				}
-			}
+		int found = -1;
+		if (view.patterns) {
+			with_dfa([&](auto step) {
+				walk(text.data(), text.size(), 0, step,
+				     [&](std::size_t j, int state) {
+					if(count_output(state)>0) {
+						save_state = state;
+						found = j;
+						return true;
+					}
+					return false;
+				});
+			});
 		}
-		return std::make_pair(-1,std::list<int>());
+		if (found == -1)
+			return std::make_pair(-1,std::list<int>());
+		return std::make_pair(found, output_strings(save_state));
+	}
+
+	// Walks the text once and calls report(position, pattern) for every
+	// occurrence of every pattern, position is the last character of
+	// the match. Overlapping matches are reported too: the outputs of a
+	// state include the outputs of all its suffixes.
+	template<typename F>
+	void search_all(const std::string& text, F report) const {
+		scan(text.data(), text.size(), 0, 0, report);
+	}
+
+	// Runs the automaton over size bytes from the given state and
+	// returns the state after them. Matches are reported as
+	// report(offset+position, pattern), so a text given in parts gets
+	// positions from its start.
+	template<typename F>
+	int scan(const char* data, std::size_t size, int state,
+		 std::uint64_t offset, F report) const {
+		if (!view.patterns)
+			return state;
+		with_dfa([&](auto step) {
+			state = walk(data, size, state, step, [&](std::size_t j, int s) {
+				if (view.output_link[s] != -1)
+					for_each_output(s, [&](int i) { report(offset+j, i); });
+				return false;
+			});
+		});
+		return state;
+	}
+
+	// Reports the matches of scan() which end at from or later, the
+	// text is split into threads parts searched at once. A part is
+	// scanned from max_length()-1 bytes before its start: no match is
+	// longer, so every match which ends in the part is found there and
+	// only there. Matches are reported in the order of a single pass.
+	template<typename F>
+	void search_parallel(const char* data, std::size_t size, std::size_t from,
+			     std::uint64_t offset, int threads, F report) const {
+		const std::size_t min_part = 1<<16;
+		std::size_t len = size-from;
+		std::size_t parts = std::max<std::size_t>(1,
+			std::min<std::size_t>(threads, len/min_part));
+		std::size_t overlap = max_len ? max_len-1 : 0;
+		std::vector<std::vector<std::pair<std::uint64_t,int>>> found(parts);
+		auto work = [&](std::size_t k) {
+			std::size_t start = from + len/parts*k;
+			std::size_t end = k==parts-1 ? size : from + len/parts*(k+1);
+			std::size_t warm = std::min(overlap, start);
+			int state = scan(data+start-warm, warm, 0, 0,
+					 [](std::uint64_t, int) {});
+			scan(data+start, end-start, state, offset+start,
+			     [&](std::uint64_t pos, int n) {
+				     found[k].emplace_back(pos, n);
+			     });
+		};
+		std::vector<std::thread> workers;
+		for(std::size_t k=1; k<parts; ++k)
+			workers.emplace_back(work, k);
+		work(0);
+		for(auto& w: workers)
+			w.join();
+		for(auto& part: found)
+			for(auto& m: part)
+				report(m.first, m.second);
 	}
 
 	std::pair<int,std::list<int>> search_with_failure(const std::string& text) {
-		if (!output.empty()) {
+		if (goto_states.empty())
+			return search_with_fsm(text);
+		if (view.patterns) {
 			int j = 0;
 			int state = 0;
 			while(j<text.size()) {
@@ -110,62 +478,1006 @@ public:
 		return std::make_pair(-1,std::list<int>());
 	}
 	
+	// Runs the trie with the failure links over the whole text, as
+	// scan() does with the automaton. Needs the trie, i.e. no compact.
+	template<typename F>
+	int scan_with_failure(const char* data, std::size_t size, int state,
+			      std::uint64_t offset, F report) const {
+		if (goto_states.empty() || !view.patterns)
+			return state;
+		for(std::size_t j=0; j<size; ++j) {
+			while(goto_f(state, data[j]) == -1)
+				state = failure[state];
+			state = goto_f(state, data[j]);
+			if (view.output_link[state] != -1)
+				for_each_output(state, [&](int i) { report(offset+j, i); });
+		}
+		return state;
+	}
+
 	int count_output(int state) const {
-		return output[state].size();
+		int n = 0;
+		for_each_output(state, [&](int) { ++n; });
+		return n;
 	}
 	
 	std::list<int> output_strings(int state) const {
-		return output[state];
+		std::list<int> r;
+		for_each_output(state, [&](int i) { r.push_back(i); });
+		return r;
+	}
+
+	// Calls f(pattern) for the patterns which end at the state: its own
+	// ones and the ones of the suffixes on the output links.
+	template<typename F>
+	void for_each_output(int state, F f) const {
+		for(int s = view.output_link[state]; s != -1;
+		    s = view.output_link[view.failure[s]]) {
+			for(int k = view.out_start[s]; k < view.out_start[s+1]; ++k)
+				f(view.out_ids[k]);
+		}
 	}
 
 	std::string get_string(int n) const {
-		return patterns[n];
+		return std::string(view.pool+view.pool_start[n],
+				   view.pool+view.pool_start[n+1]);
+	}
+	std::size_t pattern_length(int n) const {
+		return view.pool_start[n+1] - view.pool_start[n];
 	}
 	bool empty() {
-		return output.empty();
+		return !view.patterns;
+	}
+	std::size_t max_length() const {
+		return max_len;
+	}
+
+	// Bytes taken by the trie, by the failure links, by the transitions
+	// of the automaton and by the outputs with the patterns.
+	struct footprint {
+		std::size_t trie = 0;
+		std::size_t failure = 0;
+		std::size_t dfa = 0;
+		std::size_t output = 0;
+	};
+	footprint memory() const {
+		footprint m;
+		m.trie = goto_states.capacity()*sizeof(goto_states[0]);
+		m.failure = failure.capacity()*sizeof(failure[0]);
+		m.dfa = fsm.capacity()*sizeof(fsm[0]) +
+			dfa16.capacity()*sizeof(dfa16[0]) +
+			dfa32.capacity()*sizeof(dfa32[0]);
+		m.output = (out_start.capacity() + out_ids.capacity() +
+			    output_link.capacity() + pattern_state.capacity())*sizeof(int) +
+			pool.capacity() + pool_start.capacity()*sizeof(pool_start[0]);
+		return m;
 	}
 private:
-	void merge_output(int from, int to) {
-		std::list<int> temp(output[from]);
-		output[to].splice(output[to].begin(),temp);
+	// Points the tables at the arrays of a mapped file. Every number
+	// the search takes as an index is checked, a damaged file is
+	// refused rather than read out of bounds.
+	bool map_tables(const char* base, std::size_t len) {
+		file_header h;
+		std::memcpy(&h, base, sizeof(h));
+		if (!std::equal(h.magic, h.magic+sizeof(h.magic), file_magic) ||
+		    h.version != file_version ||
+		    (h.id_size != sizeof(std::uint16_t) && h.id_size != sizeof(std::uint32_t)) ||
+		    h.states == 0 || h.patterns == 0 || h.classes == 0 || h.classes > 256 ||
+		    !h.filter.valid())
+			return false;
+		std::size_t pos = 0;
+		bool fits = true;
+		auto take = [&](std::size_t n) {
+			std::size_t at = pos;
+			fits = fits && at <= len && n <= len-at;
+			pos = (at+n+file_align-1)/file_align*file_align;
+			return base + (fits ? at : 0);
+		};
+		take(sizeof(h));
+		const void* dfa = take(std::size_t(h.states)*h.classes*h.id_size);
+		auto starts = reinterpret_cast<const int*>(take((std::size_t(h.states)+1)*sizeof(int)));
+		auto ids = reinterpret_cast<const int*>(take(std::size_t(h.patterns)*sizeof(int)));
+		auto links = reinterpret_cast<const int*>(take(std::size_t(h.states)*sizeof(int)));
+		auto fails = reinterpret_cast<const int*>(take(std::size_t(h.states)*sizeof(int)));
+		auto pools = reinterpret_cast<const std::uint64_t*>(
+			take((std::size_t(h.patterns)+1)*sizeof(std::uint64_t)));
+		auto chars = take(h.pool_len);
+		if (!fits)
+			return false;
+
+		int states = h.states;
+		int patterns = h.patterns;
+		for(int i=0; i<256; ++i)
+			if (h.byte_class[i] >= h.classes)
+				return false;
+		std::size_t cells = std::size_t(h.states)*h.classes;
+		if (h.id_size == sizeof(std::uint16_t)) {
+			auto rows = static_cast<const std::uint16_t*>(dfa);
+			if (std::any_of(rows, rows+cells, [&](int to) { return to >= states; }))
+				return false;
+		} else {
+			auto rows = static_cast<const std::uint32_t*>(dfa);
+			if (std::any_of(rows, rows+cells,
+					[&](std::uint32_t to) { return to >= h.states; }))
+				return false;
+		}
+		if (starts[0] != 0 || starts[states] != patterns)
+			return false;
+		for(int s=0; s<states; ++s) {
+			if (starts[s] > starts[s+1] ||
+			    links[s] < -1 || links[s] >= states ||
+			    fails[s] < 0 || fails[s] >= states)
+				return false;
+		}
+		// The failure chains must end at the root, otherwise the output
+		// chains which follow them never end. depth[s] is the length of
+		// the failure chain of s, -2 marks a chain being followed.
+		if (fails[0] != 0 || links[0] != -1)
+			return false;
+		std::vector<int> depth(states, -1);
+		std::vector<int> chain;
+		depth[0] = 0;
+		for(int s=0; s<states; ++s) {
+			int t = s;
+			while(depth[t] == -1) {
+				depth[t] = -2;
+				chain.push_back(t);
+				t = fails[t];
+			}
+			if (depth[t] == -2)
+				return false;
+			for(; !chain.empty(); chain.pop_back())
+				depth[chain.back()] = depth[fails[chain.back()]]+1;
+		}
+		// A link goes to a state with outputs on the failure chain.
+		for(int s=0; s<states; ++s) {
+			int to = links[s];
+			if (to != -1 && (depth[to] > depth[s] || starts[to] == starts[to+1]))
+				return false;
+		}
+		for(int k=0; k<patterns; ++k)
+			if (ids[k] < 0 || ids[k] >= patterns)
+				return false;
+		std::uint64_t longest = 0;
+		if (pools[0] != 0 || pools[patterns] != h.pool_len)
+			return false;
+		for(int n=0; n<patterns; ++n) {
+			if (pools[n] > pools[n+1])
+				return false;
+			longest = std::max(longest, pools[n+1]-pools[n]);
+		}
+		if (h.max_len != longest)
+			return false;
+
+		if (h.id_size == sizeof(std::uint16_t))
+			view.dfa16 = static_cast<const std::uint16_t*>(dfa);
+		else
+			view.dfa32 = static_cast<const std::uint32_t*>(dfa);
+		view.out_start = starts;
+		view.out_ids = ids;
+		view.output_link = links;
+		view.failure = fails;
+		view.pool_start = pools;
+		view.pool = chars;
+		view.states = h.states;
+		view.patterns = h.patterns;
+		classes = h.classes;
+		max_len = h.max_len;
+		byte_class = h.byte_class;
+		filter = h.filter;
+		return true;
+	}
+
+	// Lays own outputs of the states out in one array by a counting
+	// sort of the patterns by their states.
+	void build_outputs(void) {
+		out_start.assign(goto_states.size()+1, 0);
+		for(int s: pattern_state)
+			++out_start[s+1];
+		for(std::size_t s=0; s<goto_states.size(); ++s)
+			out_start[s+1] += out_start[s];
+		out_ids.resize(pattern_state.size());
+		std::vector<int> pos(out_start.begin(), out_start.end()-1);
+		for(std::size_t n=0; n<pattern_state.size(); ++n)
+			out_ids[pos[pattern_state[n]]++] = n;
+	}
+
+	bool has_own_output(int state) const {
+		return out_start[state] != out_start[state+1];
 	}
 	
 	int goto_f(int state, char c) const {
 		return goto_states[state][0xff & c];
 	}
+
+	// Bytes which lead from every state to the same states are one
+	// class. Transitions of the automaton are taken from the trie ones,
+	// so it is enough to compare the trie columns. A byte of a trie edge
+	// shares a class with its equivalent bytes only: a state has one
+	// parent. Sets column[k] to the smallest byte of class k and returns
+	// the number of classes.
+	int build_classes(std::array<int,256>& column) {
+		std::vector<std::vector<int>> edges(256);
+		for(std::size_t s=0; s<goto_states.size(); ++s) {
+			for(int i=0; i<256; ++i) {
+				if (goto_states[s][i] > 0) {
+					edges[i].push_back(s);
+					edges[i].push_back(goto_states[s][i]);
+				}
+			}
+		}
+		std::map<std::vector<int>,int> seen;
+		classes = 0;
+		for(int i=0; i<256; ++i) {
+			auto r = seen.emplace(edges[i], classes);
+			if (r.second)
+				column[classes++] = i;
+			byte_class[i] = r.first->second;
+		}
+		return classes;
+	}
+
+	int next(int state, int k) const {
+		if (!dfa16.empty())
+			return dfa16[std::size_t(state)*classes+k];
+		if (!dfa32.empty())
+			return dfa32[std::size_t(state)*classes+k];
+		return fsm[state][k];
+	}
+
+	void set_next(int state, int k, int to) {
+		if (!dfa16.empty())
+			dfa16[std::size_t(state)*classes+k] = to;
+		else if (!dfa32.empty())
+			dfa32[std::size_t(state)*classes+k] = to;
+		else
+			fsm[state][k] = to;
+	}
+
+	// Runs step(state, c) over the bytes and calls f(position, state)
+	// after each one until it returns true, returns the last state. In
+	// the root state the filter skips to the next candidate, unless it
+	// is off for a stretch: that is run without looking at the state.
+	template<typename S, typename F>
+	int walk(const char* data, std::size_t size, int state, S step, F f) const {
+		start_filter::skipper skip(filter);
+		std::size_t j = 0;
+		while(j<size) {
+			for(std::size_t stop = std::min(size, skip.resume()); j<stop; ++j) {
+				state = step(state, data[j]);
+				if (f(j, state))
+					return state;
+			}
+			for(; j<size; ++j) {
+				if (state == 0) {
+					j = skip.next(data, j, size);
+					if (j == size || j < skip.resume())
+						break;
+				}
+				state = step(state, data[j]);
+				if (f(j, state))
+					return state;
+			}
+		}
+		return state;
+	}
+
+	// Calls f(step) with step(state, c) of the automaton in use, so the
+	// scanning loops are compiled for each layout.
+	template<typename F>
+	void with_dfa(F f) const {
+		if (view.dfa16) {
+			f([this](int state, char c) -> int {
+				return view.dfa16[std::size_t(state)*classes+byte_class[0xff & c]];
+			});
+		} else if (view.dfa32) {
+			f([this](int state, char c) -> int {
+				return view.dfa32[std::size_t(state)*classes+byte_class[0xff & c]];
+			});
+		} else {
+			f([this](int state, char c) -> int {
+				return fsm[state][0xff & c];
+			});
+		}
+	}
 	
 	std::vector<std::array<int,256>> goto_states;
 	std::vector<std::array<int,256>> fsm;
-	std::vector<std::list<int>> output;
-	std::vector<std::string> patterns;
+	// Trie edges are taken by fold[byte], the smallest equivalent byte.
+	std::array<std::uint8_t,256> fold;
+	// Compact automaton: row of a state has a column per byte class.
+	std::array<std::uint8_t,256> byte_class;
+	int classes = 0;
+	std::vector<std::uint16_t> dfa16;
+	std::vector<std::uint32_t> dfa32;
+	// Own outputs of state s are out_ids[out_start[s]..out_start[s+1]).
+	// The output link of a state is the longest suffix of it, the state
+	// itself included, which has own outputs, or -1.
+	std::vector<int> out_start;
+	std::vector<int> out_ids;
+	std::vector<int> output_link;
+	std::vector<int> pattern_state;
+	std::size_t max_len = 0;
+	start_filter filter;
+	// Pattern n is pool[pool_start[n]..pool_start[n+1]).
+	std::string pool;
+	std::vector<std::uint64_t> pool_start{0};
 	std::vector<int> failure;
 	int save_state;
+
+	// Arrays the search reads, they point to the vectors above or into
+	// the file mapped by load().
+	struct tables {
+		const std::uint16_t* dfa16 = nullptr;
+		const std::uint32_t* dfa32 = nullptr;
+		const int* out_start = nullptr;
+		const int* out_ids = nullptr;
+		const int* output_link = nullptr;
+		const int* failure = nullptr;
+		const std::uint64_t* pool_start = nullptr;
+		const char* pool = nullptr;
+		std::uint32_t states = 0;
+		std::uint32_t patterns = 0;
+	} view;
+	void* mapped = nullptr;
+	std::size_t mapped_len = 0;
+
+	// A compiled automaton file is the header and then the arrays of
+	// tables in their order, each one padded to file_align bytes.
+	static constexpr char file_magic[4] = {'F','G','R','P'};
+	static constexpr std::uint32_t file_version = 1;
+	static constexpr std::size_t file_align = 8;
+	struct file_header {
+		char magic[4];
+		std::uint32_t version;
+		std::uint32_t states;
+		std::uint32_t classes;
+		std::uint32_t patterns;
+		std::uint32_t id_size;
+		std::uint64_t max_len;
+		std::uint64_t pool_len;
+		std::array<std::uint8_t,256> byte_class;
+		start_filter filter;
+	};
 };
 
+// Which matches a search reports. all: every occurrence, overlapping
+// ones too. The leftmost kinds report matches which don't overlap: of
+// the matches which start first after the last reported one, the one
+// of the pattern added first (leftmost_first) or the longest one
+// (leftmost_longest).
+enum class match_kind { all, leftmost_first, leftmost_longest };
+
+// Search over a text which comes in parts, e.g. read by blocks from a
+// file larger than memory. The automaton state and the offset are kept
+// between the parts, so matches which span parts are found and
+// positions count from the start of the text.
+//
+// With whole_word only matches which neither follow nor are followed
+// by a letter, a digit or '_' count. The choices are made while the
+// automaton runs: a match is decided once no match which ends later
+// can start at or before it, i.e. max_length() bytes after its start,
+// so a leftmost search keeps aside only the matches of that many bytes.
+// finish() reports the matches which wait for the end of the text.
+class stream_search {
+public:
+	stream_search(const fgrep& f, match_kind kind = match_kind::all,
+		      bool whole_word = false)
+		: f(f), kind(kind), whole_word(whole_word) {}
+	template<typename F>
+	void feed(const char* data, std::size_t size, F report) {
+		if (kind == match_kind::all && !whole_word) {
+			state = f.scan(data, size, state, offset, report);
+			offset += size;
+			return;
+		}
+		if (size == 0)
+			return;
+		part = data;
+		// Matches at the end of the previous part wait for the byte
+		// after them.
+		for(auto& m: held)
+			take(m.first, m.second, report);
+		held.clear();
+		std::uint64_t last = offset+size-1;
+		state = f.scan(data, size, state, offset, [&](std::uint64_t end, int n) {
+			if (whole_word && end == last)
+				held.emplace_back(end, n);
+			else
+				take(end, n, report);
+		});
+		decide(last, report);
+		if (whole_word) {
+			std::size_t keep = f.max_length()+1;
+			if (size >= keep)
+				tail.assign(data+size-keep, keep);
+			else {
+				tail.append(data, size);
+				if (tail.size() > keep)
+					tail.erase(0, tail.size()-keep);
+			}
+		}
+		offset += size;
+	}
+	template<typename F>
+	void finish(F report) {
+		part = nullptr;
+		for(auto& m: held)
+			take(m.first, m.second, report);
+		held.clear();
+		decide(~std::uint64_t(0), report);
+	}
+	std::uint64_t position() const {
+		return offset;
+	}
+	void reset() {
+		state = 0;
+		offset = 0;
+		held.clear();
+		tail.clear();
+		waiting.clear();
+		pending_len = 0;
+		next_start = 0;
+	}
+private:
+	static bool is_word(char c) {
+		return (c>='a' && c<='z') || (c>='A' && c<='Z') ||
+			(c>='0' && c<='9') || c=='_';
+	}
+
+	// Byte at position p of the text, p is in the current part or at
+	// most max_length()+1 bytes before it.
+	char byte(std::uint64_t p) const {
+		if (p >= offset)
+			return part[p-offset];
+		return tail[tail.size()-(offset-p)];
+	}
+
+	// The byte after a match is in the current part unless the match
+	// ends the text, part is null then.
+	bool bounded(std::uint64_t start, std::uint64_t end) const {
+		if (start > 0 && is_word(byte(start-1)))
+			return false;
+		return !part || !is_word(byte(end+1));
+	}
+
+	template<typename F>
+	void take(std::uint64_t end, int n, F report) {
+		std::uint64_t len = f.pattern_length(n);
+		std::uint64_t start = end+1-len;
+		if (whole_word && !bounded(start, end))
+			return;
+		if (kind == match_kind::all) {
+			report(end, n);
+			return;
+		}
+		decide(end, report);
+		choose(end, n);
+	}
+
+	// Keeps the match aside if it starts before the one kept so far or
+	// is preferred at the same start. A match which starts later waits:
+	// it is the next one if the kept match ends before it. A match it
+	// replaces overlaps it, the matches come by their ends.
+	void choose(std::uint64_t end, int n) {
+		std::uint64_t len = f.pattern_length(n);
+		std::uint64_t start = end+1-len;
+		if (start < next_start)
+			return;
+		if (pending_len) {
+			std::uint64_t pending_start = pending_end+1-pending_len;
+			if (start > pending_start) {
+				waiting.emplace_back(end, n);
+				return;
+			}
+			if (start == pending_start &&
+			    (kind == match_kind::leftmost_first ? n > pending :
+			     len < pending_len || (len == pending_len && n > pending)))
+				return;
+		}
+		pending = n;
+		pending_end = end;
+		pending_len = len;
+	}
+
+	// Reports the match kept aside while the matches which end at end
+	// or later all start after it, the waiting matches are chosen from
+	// again after each one.
+	template<typename F>
+	void decide(std::uint64_t end, F report) {
+		while(pending_len && pending_end+1-pending_len + f.max_length() <= end) {
+			report(pending_end, pending);
+			next_start = pending_end+1;
+			pending_len = 0;
+			retry.swap(waiting);
+			for(auto& m: retry)
+				choose(m.first, m.second);
+			retry.clear();
+		}
+	}
+
+	const fgrep& f;
+	match_kind kind;
+	bool whole_word;
+	int state = 0;
+	std::uint64_t offset = 0;
+	const char* part = nullptr;
+	// Last bytes before the current part for whole_word.
+	std::string tail;
+	std::vector<std::pair<std::uint64_t,int>> held;
+	// The leftmost match so far, pending_len is 0 if there is none.
+	int pending = 0;
+	std::uint64_t pending_end = 0;
+	std::uint64_t pending_len = 0;
+	std::uint64_t next_start = 0;
+	std::vector<std::pair<std::uint64_t,int>> waiting;
+	std::vector<std::pair<std::uint64_t,int>> retry;
+};
+
+// Patterns which change while texts are searched. Every change is
+// built into a new automaton by a thread in the background, changes
+// made meanwhile are built together next time. The new automaton then
+// replaces the old one atomically: a search takes snapshot() and runs
+// it without locks, so it never waits for a build and the automaton it
+// runs stays valid until it drops the snapshot. Pattern numbers are
+// those of the snapshot, get_string() of it names them.
+class live_fgrep {
+public:
+	live_fgrep(bool compact = true, bool ignore_case = false)
+		: compact(compact), ignore_case(ignore_case),
+		  current(std::make_shared<fgrep>()),
+		  worker([this] { rebuild(); }) {}
+	live_fgrep(const live_fgrep&) = delete;
+	live_fgrep& operator=(const live_fgrep&) = delete;
+	~live_fgrep() {
+		{
+			std::lock_guard<std::mutex> lock(m);
+			stop = true;
+		}
+		changed.notify_all();
+		worker.join();
+	}
+	void add(const std::string& w) {
+		std::lock_guard<std::mutex> lock(m);
+		patterns.push_back(w);
+		++version;
+		changed.notify_all();
+	}
+	// Removes every copy of the pattern.
+	void remove(const std::string& w) {
+		std::lock_guard<std::mutex> lock(m);
+		auto end = std::remove(patterns.begin(), patterns.end(), w);
+		if (end == patterns.end())
+			return;
+		patterns.erase(end, patterns.end());
+		++version;
+		changed.notify_all();
+	}
+	std::shared_ptr<const fgrep> snapshot() const {
+		return current.load();
+	}
+	// Waits until the snapshot has every change made before.
+	void wait() {
+		std::unique_lock<std::mutex> lock(m);
+		built_cv.wait(lock, [&] { return built == version; });
+	}
+private:
+	void rebuild() {
+		std::unique_lock<std::mutex> lock(m);
+		while(true) {
+			changed.wait(lock, [&] { return stop || built != version; });
+			if (stop)
+				return;
+			std::vector<std::string> words = patterns;
+			unsigned long v = version;
+			lock.unlock();
+			auto f = std::make_shared<fgrep>();
+			if (ignore_case)
+				f->fold_case();
+			for(auto& w: words)
+				f->add(w);
+			f->build_failure(compact);
+			current.store(std::move(f));
+			lock.lock();
+			built = v;
+			built_cv.notify_all();
+		}
+	}
+
+	const bool compact;
+	const bool ignore_case;
+	std::mutex m;
+	std::condition_variable changed;
+	std::condition_variable built_cv;
+	std::vector<std::string> patterns;
+	unsigned long version = 0;
+	unsigned long built = 0;
+	bool stop = false;
+	std::atomic<std::shared_ptr<const fgrep>> current;
+	std::thread worker;
+};
+
+// Pattern sets for the benchmark: lowercase words with lengths from
+// short (3-8), long (16-48) or mixed (mostly short, up to 64).
+// Generators are seeded, so runs are comparable.
+std::vector<std::string>
+make_patterns(std::size_t count, const std::string& lengths)
+{
+	std::mt19937_64 rnd(count);
+	std::uniform_int_distribution<int> letter('a', 'z');
+	std::uniform_int_distribution<int> shortlen(3, 8), longlen(16, 48);
+	std::geometric_distribution<int> mixedlen(0.15);
+	std::vector<std::string> patterns(count);
+	for(auto& p: patterns) {
+		int len = lengths=="short" ? shortlen(rnd) :
+			lengths=="long" ? longlen(rnd) :
+			std::min(2+mixedlen(rnd), 64);
+		p.resize(len);
+		for(auto& c: p)
+			c = letter(rnd);
+	}
+	return patterns;
+}
+
+// Text of random uppercase words, with density patterns per byte
+// written over it at random places. The patterns are lowercase, so
+// matches are the planted patterns and the patterns inside them.
+std::string
+make_text(std::size_t size, const std::vector<std::string>& patterns,
+	  double density)
+{
+	std::mt19937_64 rnd(size);
+	std::uniform_int_distribution<int> letter('A', 'Z'), wordlen(1, 10);
+	std::string text(size, ' ');
+	for(std::size_t i=0; i<size; ) {
+		for(int k=wordlen(rnd); k>0 && i<size; --k)
+			text[i++] = letter(rnd);
+		++i;
+	}
+	std::uniform_int_distribution<std::size_t> place(0, size-1);
+	std::uniform_int_distribution<std::size_t> pick(0, patterns.size()-1);
+	for(std::size_t n = size*density; n>0; --n) {
+		const std::string& p = patterns[pick(rnd)];
+		std::size_t at = place(rnd);
+		text.replace(at, std::min(p.size(), size-at), p, 0, size-at);
+	}
+	return text;
+}
+
+// States of the trie of the patterns: the distinct prefixes, the empty
+// one included.
+std::size_t
+count_states(std::vector<std::string> patterns)
+{
+	std::sort(patterns.begin(), patterns.end());
+	std::size_t states = 1;
+	for(std::size_t n=0; n<patterns.size(); ++n) {
+		std::size_t common = 0;
+		if (n > 0) {
+			auto& prev = patterns[n-1];
+			while(common < prev.size() && common < patterns[n].size() &&
+			      prev[common] == patterns[n][common])
+				++common;
+		}
+		states += patterns[n].size()-common;
+	}
+	return states;
+}
+
+// Builds the automata of synthetic pattern sets and scans synthetic
+// texts with each engine: the trie with failure links, the full
+// automaton and the compact one. Prints build time, memory and scan
+// speed by match density, and checks that the engines find the same
+// matches, by a hash of the (position, pattern) sequence. The failure
+// engine reads the trie and not the automaton, its dfa is not shown.
+// An automaton with a trie over memory_limit is skipped. Then times a
+// change of a live_fgrep which is being scanned.
+bool
+benchmark(std::size_t size)
+{
+	using clock = std::chrono::steady_clock;
+	const std::size_t memory_limit = std::size_t(2)<<30;
+	const int runs = 2;
+	const double densities[] = {0, 1e-4, 1e-2};
+	const char* density_names[] = {"0", "1e-4", "1e-2"};
+	bool ok = true;
+	auto seconds = [](clock::time_point start) {
+		return std::chrono::duration<double>(clock::now()-start).count();
+	};
+	std::cout<<std::left<<std::setw(9)<<"patterns"<<std::setw(7)<<"length"
+		 <<std::setw(9)<<"engine"<<std::right<<std::setw(10)<<"states"
+		 <<std::setw(9)<<"build s"<<std::setw(10)<<"trie MB"
+		 <<std::setw(10)<<"links MB"<<std::setw(10)<<"dfa MB"
+		 <<std::setw(10)<<"out MB";
+	for(auto name: density_names)
+		std::cout<<std::setw(10)<<"GB/s:"+std::string(name)<<std::setw(11)<<"m/MB";
+	std::cout<<std::endl;
+	for(std::string lengths: {"short", "mixed", "long"}) {
+		for(std::size_t count: {10, 100, 1000, 10000, 100000, 1000000}) {
+			auto patterns = make_patterns(count, lengths);
+			std::size_t states = count_states(patterns);
+			std::size_t row = sizeof(std::array<int,256>);
+			std::vector<std::string> texts;
+			for(double d: densities)
+				texts.push_back(make_text(size, patterns, d));
+			std::vector<std::uint64_t> found(texts.size(), 0);
+			bool first = true;
+			for(std::string engine: {"failure", "full", "compact"}) {
+				std::cout<<std::left<<std::setw(9)<<count<<std::setw(7)
+					 <<lengths<<std::setw(9)<<engine<<std::right
+					 <<std::setw(10)<<states;
+				bool compact = engine=="compact";
+				// The full automaton has a row of the trie size.
+				if (states*row*(compact ? 1 : 2) > memory_limit) {
+					std::cout<<"  skipped, over "<<(memory_limit>>20)
+						 <<" MB"<<std::endl;
+					continue;
+				}
+				auto start = clock::now();
+				fgrep f;
+				for(auto& p: patterns)
+					f.add(p);
+				auto trie = f.memory().trie;
+				f.build_failure(compact);
+				double build = seconds(start);
+				auto m = f.memory();
+				std::cout<<std::fixed<<std::setprecision(3)<<std::setw(9)<<build
+					 <<std::setprecision(1)<<std::setw(10)<<trie/1e6
+					 <<std::setw(10)<<m.failure/1e6;
+				if (engine=="failure")
+					std::cout<<std::setw(10)<<"-";
+				else
+					std::cout<<std::setw(10)<<m.dfa/1e6;
+				std::cout<<std::setw(10)<<m.output/1e6;
+				for(std::size_t t=0; t<texts.size(); ++t) {
+					double best = 1e100;
+					std::uint64_t matches = 0;
+					std::uint64_t hash = 0;
+					for(int r=0; r<runs; ++r) {
+						matches = 0;
+						hash = 0;
+						auto count_match = [&](std::uint64_t pos, int n) {
+							++matches;
+							hash = (hash ^ (pos<<20 ^ n))*0x100000001b3;
+						};
+						start = clock::now();
+						if (engine=="failure")
+							f.scan_with_failure(texts[t].data(), size, 0, 0, count_match);
+						else
+							f.scan(texts[t].data(), size, 0, 0, count_match);
+						best = std::min(best, seconds(start));
+					}
+					if (first)
+						found[t] = hash;
+					else if (found[t] != hash)
+						ok = false;
+					std::cout<<std::setprecision(3)<<std::setw(10)<<size/best/1e9
+						 <<std::setprecision(0)<<std::setw(11)<<matches*1e6/size;
+				}
+				first = false;
+				std::cout<<std::endl;
+			}
+		}
+	}
+	if (!ok)
+		std::cout<<"engines found different matches: FAILED"<<std::endl;
+
+	// A live set takes one new pattern while a thread scans with its
+	// snapshots: the time until the snapshot has it, and the longest
+	// scan before and while it is built. Scans wait for no lock, a
+	// longer scan during the build is the build taking the CPU.
+	std::cout<<std::endl<<std::left<<std::setw(9)<<"patterns"<<std::setw(7)<<"length"
+		 <<std::right<<std::setw(11)<<"rebuild s"<<std::setw(8)<<"scans"
+		 <<std::setw(14)<<"idle max ms"<<std::setw(17)<<"rebuild max ms"<<std::endl;
+	for(std::size_t count: {1000, 10000, 100000}) {
+		auto patterns = make_patterns(count, "short");
+		auto text = make_text(size, patterns, 1e-4);
+		live_fgrep live;
+		for(auto& p: patterns)
+			live.add(p);
+		live.wait();
+		std::atomic<bool> stop(false), rebuilding(false);
+		std::atomic<int> idle_scans(0);
+		int rebuild_scans = 0;
+		double idle_max = 0, rebuild_max = 0;
+		// The new pattern is not in the text, every scan finds the same.
+		std::uint64_t first_found = 0;
+		bool same = true;
+		std::thread scanner([&] {
+			while(!stop) {
+				bool during = rebuilding;
+				std::uint64_t found = 0;
+				auto start = clock::now();
+				live.snapshot()->scan(text.data(), size, 0, 0,
+						      [&](std::uint64_t, int) { ++found; });
+				double t = seconds(start)*1e3;
+				if (idle_scans == 0 && !during)
+					first_found = found;
+				same = same && found == first_found;
+				if (during) {
+					rebuild_max = std::max(rebuild_max, t);
+					++rebuild_scans;
+				} else {
+					idle_max = std::max(idle_max, t);
+					++idle_scans;
+				}
+			}
+		});
+		while(idle_scans < runs)
+			std::this_thread::yield();
+		rebuilding = true;
+		auto start = clock::now();
+		live.add("benchmark");
+		live.wait();
+		double rebuild = seconds(start);
+		rebuilding = false;
+		stop = true;
+		scanner.join();
+		auto f = live.snapshot();
+		if (f->get_string(count) != "benchmark" || !same) {
+			std::cout<<"scans of the live set changed: FAILED"<<std::endl;
+			ok = false;
+		}
+		std::cout<<std::left<<std::setw(9)<<count<<std::setw(7)<<"short"
+			 <<std::right<<std::setprecision(3)<<std::setw(11)<<rebuild
+			 <<std::setw(8)<<rebuild_scans<<std::setprecision(1)
+			 <<std::setw(14)<<idle_max<<std::setw(17);
+		if (rebuild_scans)
+			std::cout<<rebuild_max<<std::endl;
+		else
+			std::cout<<"-"<<std::endl;
+	}
+	return ok;
+}
+
+void
+usage(const char* prog)
+{
+	std::cerr<<"Usage: "<<prog<<": [-a] [-c] [-i] [-e bytes] [-j threads] [-k kind] [-w] <patterns_file> <text_file>"<<std::endl;
+	std::cerr<<"       "<<prog<<": [-i] [-e bytes] -s <automaton_file> <patterns_file>"<<std::endl;
+	std::cerr<<"       "<<prog<<": [-a] [-j threads] [-k kind] [-w] -m <automaton_file> <text_file>"<<std::endl;
+	std::cerr<<"       "<<prog<<": -b [megabytes]"<<std::endl;
+	std::cerr<<"  -a prints every match as <position> <pattern>, the text is read"<<std::endl;
+	std::cerr<<"     by blocks, \"-\" stands for stdin"<<std::endl;
+	std::cerr<<"  -c builds the compact automaton"<<std::endl;
+	std::cerr<<"  -i ignores case of ASCII letters"<<std::endl;
+	std::cerr<<"  -e makes the bytes match each other, may be repeated"<<std::endl;
+	std::cerr<<"  -j searches with -a in that many threads"<<std::endl;
+	std::cerr<<"  -k first|longest prints with -a the leftmost matches which don't"<<std::endl;
+	std::cerr<<"     overlap, of the pattern given first or the longest one"<<std::endl;
+	std::cerr<<"  -w prints with -a the matches of whole words only"<<std::endl;
+	std::cerr<<"  -s saves the compact automaton of the patterns into a file"<<std::endl;
+	std::cerr<<"  -m maps the automaton saved with -s instead of the patterns"<<std::endl;
+	std::cerr<<"  -b runs the benchmark over synthetic patterns and texts of that"<<std::endl;
+	std::cerr<<"     size, 16 MB by default, with 0, 1e-4 and 1e-2 planted matches"<<std::endl;
+	std::cerr<<"     per byte; m/MB is the matches found per MB"<<std::endl;
+}
+
 int
 main(int ac, char *av[])
 {
-	if (ac!=3) {
-		std::cerr<<"Usage: "<<av[0]<<": <patterns_file> <text_file>"<<std::endl;
+	bool all = false;
+	bool compact = false;
+	int threads = std::max(1u, std::thread::hardware_concurrency());
+	const char* save = nullptr;
+	const char* load = nullptr;
+	bool ignore_case = false;
+	match_kind kind = match_kind::all;
+	bool whole_word = false;
+	std::vector<std::string> sets;
+	if (ac>1 && std::string(av[1])=="-b") {
+		std::size_t mb = ac>2 ? std::atoi(av[2]) : 16;
+		return benchmark(mb<<20) ? 0 : 1;
+	}
+	int arg = 1;
+	for(; arg<ac-1 && av[arg][0]=='-'; ++arg) {
+		std::string opt(av[arg]);
+		if (opt=="-a")
+			all = true;
+		else if (opt=="-c")
+			compact = true;
+		else if (opt=="-i")
+			ignore_case = true;
+		else if (opt=="-e" && arg+1<ac)
+			sets.push_back(av[++arg]);
+		else if (opt=="-k" && arg+1<ac && std::string(av[arg+1])=="first") {
+			kind = match_kind::leftmost_first;
+			++arg;
+		} else if (opt=="-k" && arg+1<ac && std::string(av[arg+1])=="longest") {
+			kind = match_kind::leftmost_longest;
+			++arg;
+		} else if (opt=="-w")
+			whole_word = true;
+		else if (opt=="-j" && arg+1<ac && (threads = std::atoi(av[++arg])) > 0)
+			continue;
+		else if (opt=="-s" && arg+1<ac && !load)
+			save = av[++arg];
+		else if (opt=="-m" && arg+1<ac && !save)
+			load = av[++arg];
+		else {
+			usage(av[0]);
+			return 1;
+		}
+	}
+	if (ac-arg != (save || load ? 1 : 2)) {
+		usage(av[0]);
 		return 1;
 	}
+	av += arg-1;
 	fgrep f;
-	std::string w;
-	std::ifstream in(av[1]);
-	
-	while(in>>w)
-		f.add(w);
-	f.build_failure();
+	if (load) {
+		if (!f.load(load)) {
+			std::cerr<<"Can't load "<<load<<std::endl;
+			return 1;
+		}
+		--av;
+	} else {
+		if (ignore_case)
+			f.fold_case();
+		for(auto& bytes: sets)
+			f.equivalent(bytes);
+		std::string w;
+		std::ifstream in(av[1]);
+
+		while(in>>w)
+			f.add(w);
+		f.build_failure(compact || save);
+	}
+	if (save) {
+		if (!f.empty() && !f.save(save)) {
+			std::cerr<<"Can't save "<<save<<std::endl;
+			return 1;
+		}
+		if (f.empty())
+			std::cerr<<"Empty pattern!"<<std::endl;
+		return 0;
+	}
 
 	if (f.empty()) {
 		std::cerr<<"Empty pattern!"<<std::endl;
 		return 0;
 	}
 	
-	std::ifstream itext(av[2]);
-	std::string text;
-	std::copy(std::istream_iterator<char>(itext), std::istream_iterator<char>(),
-		  std::back_inserter(text));
+	std::ifstream itext;
+	std::istream& is = std::string(av[2])=="-" ? std::cin : itext;
+	if (&is == &itext)
+		itext.open(av[2], std::ios::binary);
+	if (!is) {
+		std::cerr<<"Can't open "<<av[2]<<std::endl;
+		return 1;
+	}
+
+	if (all) {
+		auto print = [&](std::uint64_t pos, int n) {
+			std::cout<<pos<<" "<<f.get_string(n)<<'\n';
+		};
+		if (threads == 1 || kind != match_kind::all || whole_word) {
+			stream_search s(f, kind, whole_word);
+			std::vector<char> buf(1<<20);
+			while(is.read(buf.data(), buf.size()) || is.gcount())
+				s.feed(buf.data(), is.gcount(), print);
+			s.finish(print);
+		} else {
+			// The last max_length()-1 bytes of a block are kept in
+			// front of the next one for the matches across blocks.
+			std::size_t overlap = f.max_length()-1;
+			std::vector<char> buf(overlap + threads*(std::size_t(4)<<20));
+			std::size_t kept = 0;
+			std::uint64_t offset = 0;
+			while(is.read(buf.data()+kept, buf.size()-kept) || is.gcount()) {
+				std::size_t size = kept+is.gcount();
+				f.search_parallel(buf.data(), size, kept, offset-kept,
+						  threads, print);
+				offset += is.gcount();
+				kept = std::min(overlap, size);
+				std::memmove(buf.data(), buf.data()+size-kept, kept);
+			}
+		}
+		std::cout.flush();
+		return 0;
+	}
+
+	std::string text(std::istreambuf_iterator<char>(is), {});
 
 	auto r = f.search_with_fsm(text);
 
@@ -1,559 +1,2058 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <queue>
 #include <cstdint>
-#include <unordered_map>
 #include <bitset>
 #include <stdexcept>
+#include <array>
+#include <cstring>
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <exception>
+#include <string>
+#include <iterator>
+#include <sstream>
+#include <iomanip>
+#include <chrono>
+#include <random>
+#include <span>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#ifdef __SSE4_2__
+#include <nmmintrin.h>
+#endif
 
 namespace pack {
 
-  using bits=std::vector<std::uint8_t>;
-  using prefix_map=std::unordered_map<std::uint8_t,bits>;
+  using frequences=std::vector<std::uint64_t>;
+
+  // Code lengths are all what is needed to restore canonical codes:
+  // codes of the same length are consecutive numbers in the symbols
+  // order and shorter codes go first. Zero length means that a symbol
+  // is not used.
+  using code_lengths=std::array<std::uint8_t,256>;
 
   // There is a problem with word_size. The longest bit prefix 
   // length can be equal to unique charachters amount - 1 
-  // Fortunately in order to have maximum trie height characters 
-  // frequences should be in fibbonachi sequence. May be better 
-  // to store frequences and recreate trie every time.
+  // Fortunately in order to have maximum tree height characters 
+  // frequences should be in fibbonachi sequence. compress() limits
+  // code length to max_code_len with package-merge, so only old "HM"
+  // files can hit the word_size ceiling.
  
   constexpr int word_size=64;
   using word_t=std::uint64_t;
+  constexpr int max_code_len=15;
 
-  struct node {
-    node (int f,char c): freq(f),chr(c),zero_link(nullptr),
-					one_link(nullptr)
-    {}
-    int freq;
-    std::uint8_t chr;
-    node* zero_link;
-    node* one_link;
-  };
-
+  // Version of the "HC" container written by compress(). Version 1
+  // is a single Huffman coded text, version 2 is a sequence of
+  // independently coded blocks with an index at the end, version 3
+  // adds checksums of the blocks and of the index.
+  constexpr char format_version=3;
+  constexpr std::uint32_t block_size=1<<20;
 
   struct prefix {
     std::uint8_t chr;
     std::uint8_t plen;
     void set(int num, bool val) {
-      pref &= ~(1<<num);
+      pref &= ~(word_t(1)<<num);
       if (val)
-	pref |= 1<<num;
+	pref |= word_t(1)<<num;
     }
     bool get(int num) const {
-      return pref & (1<<num);
+      return pref & (word_t(1)<<num);
     }
     // Should be array of bytes in order not to deal with MSB & LSB.
     word_t pref; 
   };
   
   
-class trie {
-public:
-  trie(): root(nullptr)
-  {}
-  void from_vector(const std::vector<prefix>& tbl);
-  void from_frequences(const std::vector<int>& chars) {
-    root = build_from_frequences(chars);
+  // Huffman tree over a flat array with index links, nothing is
+  // allocated. Leaves sorted by weight go first and inner nodes are
+  // appended as they are made. Inner nodes are made in non-decreasing
+  // weight order, so the two lightest nodes are always at the heads of
+  // the leaves and of the inner nodes. A parent goes after its
+  // children, so one pass from the root down replaces weights by
+  // depths in place.
+  class huffman_tree {
+  public:
+    code_lengths lengths(const frequences& freq);
+  private:
+    struct tree_node {
+      std::uint64_t weight;
+      std::uint16_t parent;
+      std::uint8_t sym;
+    };
+    std::array<tree_node,2*256-1> nodes;
+  };
+
+  inline code_lengths
+  huffman_tree::lengths(const frequences& freq)
+  {
+    code_lengths lens{};
+    int n=0;
+    for(int c=0;c<256;++c) {
+      if (freq[c])
+	nodes[n++]=tree_node{freq[c],0,static_cast<std::uint8_t>(c)};
+    }
+    if (n<2) {
+      // A single symbol still needs a bit, zero length is for absent.
+      if (n)
+	lens[nodes[0].sym]=1;
+      return lens;
+    }
+    std::sort(nodes.begin(),nodes.begin()+n,
+	      [](const tree_node& a,const tree_node& b) {
+		return a.weight<b.weight || (a.weight==b.weight && a.sym<b.sym);
+	      });
+    
+    int leaf=0,inner=n,end=n;
+    auto lightest=[&]() {
+      if (leaf<n && (inner==end || nodes[leaf].weight<=nodes[inner].weight))
+	return leaf++;
+      return inner++;
+    };
+    for(;end<2*n-1;++end) {
+      int one=lightest();
+      int two=lightest();
+      nodes[end]=tree_node{nodes[one].weight+nodes[two].weight,0,0};
+      nodes[one].parent=nodes[two].parent=end;
+    }
+    
+    nodes[end-1].weight=0;
+    for(int i=end-2;i>=0;--i)
+      nodes[i].weight=nodes[nodes[i].parent].weight+1;
+    for(int i=0;i<n;++i)
+      lens[nodes[i].sym]=nodes[i].weight;
+    return lens;
   }
-  prefix_map to_map(void) {
-    return to_map(root);
+
+
+  // Little-endian bit reader over a memory buffer. The first bit of
+  // the stream is the least significant bit of the first byte, the
+  // same order bin_writer uses. The buffer is refilled up to 56 bits
+  // at once, so several codes are resolved between refills.
+  class bit_reader {
+  public:
+    bit_reader(): pos(nullptr),end(nullptr),buf(0),count(0)
+    {}
+    bit_reader(const std::uint8_t* data,std::size_t size): 
+      pos(data),end(data+size),buf(0),count(0)
+    {}
+    void refill(void) {
+      if (end-pos>=8) {
+	word_t w;
+	std::memcpy(&w,pos,sizeof(w));
+	buf |= w<<count;
+	pos += (63-count)>>3;
+	count |= 56;
+      } else {
+	while (count<=56 && pos<end) {
+	  buf |= static_cast<word_t>(*pos++)<<count;
+	  count += 8;
+	}
+      }
+    }
+    word_t peek(word_t mask) const {
+      return buf & mask;
+    }
+    // Past the end of the stream the count goes negative, it is
+    // checked once by overrun() instead of on every code.
+    void consume(int n) {
+      buf >>= n;
+      count -= n;
+    }
+    bool overrun(void) const {
+      return count<0;
+    }
+  private:
+    const std::uint8_t* pos;
+    const std::uint8_t* end;
+    word_t buf;
+    int count;
+  };
+
+
+  // Multi-level decoding table. The first level is indexed by the next
+  // root_bits bits of the stream and resolves every code not longer
+  // than that with one lookup. Longer codes go through a link entry to the
+  // next level table which is indexed by the following bits.
+  class decode_table {
+  public:
+    static constexpr int root_bits=11;
+    
+    decode_table(): first_mask(0),max_len(0)
+    {}
+    void build(const std::vector<prefix>& codes);
+    void decode(const std::uint8_t* data,std::size_t size,
+		std::uint8_t* out,std::size_t out_size) const;
+    // Decodes one symbol, the reader should be refilled before.
+    std::uint8_t next(bit_reader& in) const {
+      const entry& e=table[in.peek(first_mask)];
+      if (e.kind==leaf) {
+	in.consume(e.len);
+	return e.val;
+      }
+      return next_level(in,&e);
+    }
+    // Symbols per refill: a refill gives at least 56 bits.
+    int per_refill(void) const {
+      return 56/std::max(max_len,1);
+    }
+  private:
+    enum kind_t: std::uint8_t { none=0, leaf, link };
+    struct entry {
+      std::uint32_t val; // symbol for a leaf, next level offset for a link
+      std::uint8_t len;  // bits consumed at this level
+      std::uint8_t sub;  // index width of the next level
+      kind_t kind;
+    };
+    void fill(const prefix** first,const prefix** last,std::size_t base,
+	      int shift,int width);
+    std::uint8_t next_level(bit_reader& in,const entry* e) const;
+    std::vector<entry> table;
+    std::vector<const prefix*> all;
+    word_t first_mask;
+    int max_len;
+  };
+
+  inline std::uint8_t
+  decode_table::next_level(bit_reader& in,const entry* e) const
+  {
+    while (e->kind==link) {
+      in.consume(e->len);
+      in.refill();
+      e=&table[e->val+in.peek((word_t(1)<<e->sub)-1)];
+    }
+    if (e->kind!=leaf) {
+      throw std::logic_error("Invalid bits sequence in data: "
+			     "no such code in the table");
+    }
+    in.consume(e->len);
+    return e->val;
   }
-  template<typename FUNC>
-  void decode(const std::string& text,FUNC& f,int padding_bits);
-  prefix find(std::bitset<word_size> bit_sequence,int blen) {
-    return find_char(root,bit_sequence,0,blen);
+
+  inline void
+  decode_table::build(const std::vector<prefix>& codes)
+  {
+    max_len=0;
+    all.clear();
+    for(auto& c: codes) {
+      if (c.plen>word_size) {
+	throw std::logic_error("Invalid prefix table: too long code");
+      }
+      max_len=std::max<int>(max_len,c.plen);
+      all.push_back(&c);
+    }
+    int first_bits=std::min(max_len,root_bits);
+    first_mask=(word_t(1)<<first_bits)-1;
+    table.assign(std::size_t(1)<<first_bits,entry{0,0,0,none});
+    if (!all.empty())
+      fill(all.data(),all.data()+all.size(),0,0,first_bits);
   }
-private:
-  prefix_map  to_map(node* prefixes);
-  prefix find_char(node* rt,std::bitset<word_size> bit_sequence,
-		   int bit_pos,int blen);
-  void walk(node* rt,const bits& pref,prefix_map& tbl);
-  node* build_from_frequences(const std::vector<int>& chars); 
-  void add_leaf(node* n,const prefix& ent, int bit_pos);
-  node* root;
-};
+
+  // Fills the table of 2^width entries at base for codes [first,last)
+  // which share first shift bits. Longer codes are moved to the end
+  // and grouped by their next width bits, each group gets a next level
+  // table.
+  inline void
+  decode_table::fill(const prefix** first,const prefix** last,
+		     std::size_t base,int shift,int width)
+  {
+    const word_t mask=(word_t(1)<<width)-1;
+    auto longer=std::partition(first,last,[&](const prefix* c) {
+	return c->plen-shift<=width;
+      });
+    for(auto p=first;p!=longer;++p) {
+      auto c=*p;
+      int rest=c->plen-shift;
+      std::size_t idx= (c->pref>>shift) & ((word_t(1)<<rest)-1);
+      for(std::size_t k=0;k<(std::size_t(1)<<(width-rest));++k) {
+	entry& e=table[base+(idx|(k<<rest))];
+	if (e.kind!=none) {
+	  throw std::logic_error("Invalid prefix table: "
+				 "codes are not prefix free");
+	}
+	e=entry{c->chr,static_cast<std::uint8_t>(rest),0,leaf};
+      }
+    }
+    std::sort(longer,last,[&](const prefix* a,const prefix* b) {
+	return ((a->pref>>shift)&mask)<((b->pref>>shift)&mask);
+      });
+    for(auto p=longer;p!=last;) {
+      std::size_t idx=((*p)->pref>>shift)&mask;
+      if (table[base+idx].kind!=none) {
+	throw std::logic_error("Invalid prefix table: "
+			       "codes are not prefix free");
+      }
+      int max_rest=0;
+      auto group=p;
+      for(;p!=last && (((*p)->pref>>shift)&mask)==idx;++p)
+	max_rest=std::max(max_rest,(*p)->plen-shift-width);
+      int sub=std::min(max_rest,root_bits);
+      std::size_t next=table.size();
+      table.resize(next+(std::size_t(1)<<sub),entry{0,0,0,none});
+      table[base+idx]=entry{static_cast<std::uint32_t>(next),
+			    static_cast<std::uint8_t>(width),
+			    static_cast<std::uint8_t>(sub),link};
+      fill(group,p,next,shift+width,sub);
+    }
+  }
+
+  // Symbol sources of decode_streams(). An order-0 source decodes with
+  // one table, an order-1 source chooses the table by the previous
+  // symbol of its stream.
+  struct order0_source {
+    const decode_table* table;
+    std::uint8_t operator()(bit_reader& in) {
+      return table->next(in);
+    }
+  };
   
+  struct order1_source {
+    const decode_table* const* tables;
+    std::uint8_t prev;
+    std::uint8_t operator()(bit_reader& in) {
+      return prev=tables[prev]->next(in);
+    }
+  };
   
-  void
-  trie::add_leaf(node* nroot,const prefix& entry, int bit_pos)
+  inline void
+  check_overrun(const bit_reader* in,int n)
   {
-    if (bit_pos == entry.plen) { // it's a leaf
-      nroot->chr=entry.chr;
-    } else {
-      if (entry.get(bit_pos)) {
-	if (!nroot->one_link) 
-	  nroot->one_link= new node(0,0);
-	add_leaf(nroot->one_link,entry,bit_pos+1);
-      } else {
-	if (!nroot->zero_link)
-	  nroot->zero_link = new node(0,0);
-	add_leaf(nroot->zero_link,entry,bit_pos+1);
+    bool over=false;
+    for(int s=0;s<n;++s)
+      over |= in[s].overrun();
+    if (over) {
+      throw std::logic_error("Invalid bits sequence in data: "
+			     "unexpected end of stream");
+    }
+  }
+
+  // Decodes n symbols of each of N streams by K symbols per refill.
+  // The streams are checked after every refill batch, so damaged data
+  // stops the decoding close to the end of the stream.
+  template<int N,int K,typename SRC>
+  std::size_t
+  decode_run(SRC* src,bit_reader* in,std::uint8_t* const* out,std::size_t n)
+  {
+    std::size_t i=0;
+    for(;i+K<=n;i+=K) {
+      for(int s=0;s<N;++s)
+	in[s].refill();
+      for(int k=0;k<K;++k) {
+	for(int s=0;s<N;++s)
+	  out[s][i+k]=src[s](in[s]);
       }
+      check_overrun(in,N);
     }
+    return i;
   }
 
+  // The text is split into N parts coded as separate streams. The
+  // parts are decoded in lock-step, so lookups of different streams do
+  // not wait for each other. The last part takes the remainder.
+  template<int N,typename SRC>
   void
-  trie::from_vector(const std::vector<prefix>& tbl)
+  decode_streams(SRC* src,bit_reader* in,std::uint8_t* out,
+		 std::size_t out_size,int per_refill)
   {
-    root=new node(0,0);
-    for(auto& entry: tbl) {
-      add_leaf(root,entry,0);
+    std::size_t part=out_size/N;
+    std::uint8_t* outs[N];
+    for(int s=0;s<N;++s)
+      outs[s]=out+s*part;
+    std::size_t done=0;
+    switch (per_refill) {
+    case 1: break;
+    case 2: done=decode_run<N,2>(src,in,outs,part); break;
+    case 3: done=decode_run<N,3>(src,in,outs,part); break;
+    default: done=decode_run<N,4>(src,in,outs,part); break;
+    }
+    for(int s=0;s<N;++s)
+      outs[s] += done;
+    decode_run<N,1>(src,in,outs,part-done);
+    outs[N-1] += part-done;
+    decode_run<1,1>(src+N-1,in+N-1,outs+N-1,out_size-N*part);
+    check_overrun(in,N);
   }
+
+  inline void
+  decode_table::decode(const std::uint8_t* data,std::size_t size,
+		       std::uint8_t* out,std::size_t out_size) const
+  {
+    bit_reader in(data,size);
+    order0_source src{this};
+    decode_streams<1>(&src,&in,out,out_size,per_refill());
   }
+
+
+  // Code of a symbol ready to be put into the stream, the first bit
+  // of the code is the least significant one.
+  struct code {
+    word_t bits;
+    std::uint8_t len;
+  };
+  using code_table=std::array<code,256>;
   
-  struct gt {
-    bool operator()(const node* lhs,const  node* rhs) {
-      return lhs->freq>rhs->freq;
-    } 
+  // Collects codes in a 64-bit accumulator and stores it into the
+  // output buffer as a whole word when it is full. The caller provides
+  // a buffer big enough for all the bits rounded up to the 8 bytes.
+  class bit_writer {
+  public:
+    bit_writer(std::uint8_t* o): out(o),pos(o),acc(0),count(0)
+    {}
+    void put(word_t bits,int len) {
+      acc |= bits<<count;
+      if (count+len>=word_size) {
+	store(acc);
+	int used=word_size-count;
+	acc = used<word_size ? bits>>used : 0;
+	count += len-word_size;
+      } else {
+	count += len;
+      }
+    }
+    // Stores bits left in the accumulator and returns the number of
+    // bytes in the stream.
+    std::size_t finish(void) {
+      if (count) {
+	store(acc);
+	pos -= (word_size-count)/8;
+	acc=0;
+	count=0;
+      }
+      return pos-out;
+    }
+  private:
+    void store(word_t w) {
+      std::memcpy(pos,&w,sizeof(w));
+      pos += sizeof(w);
+    }
+    std::uint8_t* out;
+    std::uint8_t* pos;
+    word_t acc;
+    int count;
   };
 
-  node* 
-  trie::build_from_frequences(const std::vector<int>& chars) 
+
+  // Package-merge: optimal code lengths which are not longer than
+  // max_len. The items of the last list are either symbols or
+  // packages of two items of the previous list. Length of a symbol
+  // code is the number of times the symbol is used by the first
+  // 2n-2 items of the last list.
+  inline code_lengths
+  limited_lengths(const frequences& freq,int max_len)
   {
-    std::priority_queue<node*,std::vector<node*>,gt> min_heap;
-    
-    for(int c=0;c<256;c++) {
-      if (chars[c]) {
-	min_heap.push(new node(chars[c],c));
+    struct item {
+      std::uint64_t weight;
+      int sym;
+      int left;
+      int right;
+    };
+    std::vector<item> pool;
+    for(int c=0;c<256;++c) {
+      if (freq[c])
+	pool.push_back(item{freq[c],c,-1,-1});
+    }
+    std::sort(pool.begin(),pool.end(),[](const item& a,const item& b) {
+	return a.weight<b.weight || (a.weight==b.weight && a.sym<b.sym);
+      });
+
+    code_lengths lens{};
+    int n=pool.size();
+    if (n<2) {
+      if (n)
+	lens[pool[0].sym]=1;
+      return lens;
+    }
+    if (max_len<word_size && (word_t(1)<<max_len)<static_cast<word_t>(n)) {
+      throw std::logic_error("Code length limit is too small");
+    }
+
+    std::vector<int> list(n),merged;
+    for(int i=0;i<n;++i)
+      list[i]=i;
+    for(int level=1;level<max_len;++level) {
+      int first_package=pool.size();
+      for(std::size_t i=0;i+1<list.size();i+=2) {
+	pool.push_back(item{pool[list[i]].weight+pool[list[i+1]].weight,-1,
+			    list[i],list[i+1]});
       }
+      int last_package=pool.size();
+      merged.clear();
+      int leaf=0,package=first_package;
+      while (leaf<n || package<last_package) {
+	if (package==last_package || 
+	    (leaf<n && pool[leaf].weight<=pool[package].weight))
+	  merged.push_back(leaf++);
+	else
+	  merged.push_back(package++);
+      }
+      list.swap(merged);
     }
-    
-    node* one=nullptr,*two=nullptr;
-    while(!min_heap.empty()) {
-      one=min_heap.top();
-      min_heap.pop();
-      if (!min_heap.empty()) {
-	two=min_heap.top();
-	min_heap.pop();
-	
-	node* new_node = new node(one->freq+two->freq,0);
-	new_node->zero_link=one;
-	new_node->one_link=two;
-	
-	min_heap.push(new_node);
+
+    std::vector<int> stack(list.begin(),list.begin()+2*n-2);
+    while (!stack.empty()) {
+      const item& it=pool[stack.back()];
+      stack.pop_back();
+      if (it.sym>=0) {
+	lens[it.sym]++;
+      } else {
+	stack.push_back(it.left);
+	stack.push_back(it.right);
       }
     }
-    return one;
+    return lens;
   }
 
+  // Huffman code lengths. When the tree is higher than max_len the
+  // lengths are rebuilt with package-merge.
+  inline code_lengths
+  huffman_lengths(const frequences& freq,int max_len)
+  {
+    huffman_tree tree;
+    code_lengths lens=tree.lengths(freq);
+    for(auto len: lens) {
+      if (len>max_len)
+	return limited_lengths(freq,max_len);
+    }
+    return lens;
+  }
 
+  // Assigns canonical codes. Canonical code is defined most significant
+  // bit first, so it is reversed to go into the stream.
+  inline code_table
+  canonical_codes(const code_lengths& lens)
+  {
+    std::array<word_t,word_size+1> count{},next{};
+    for(int c=0;c<256;++c) {
+      if (lens[c]>word_size) {
+	throw std::logic_error("Code is too long for a word");
+      }
+      count[lens[c]]++;
+    }
+    count[0]=0;
+    word_t val=0;
+    for(int len=1;len<=word_size;++len) {
+      val=(val+count[len-1])<<1;
+      next[len]=val;
+    }
+    code_table codes{};
+    for(int c=0;c<256;++c) {
+      int len=lens[c];
+      if (!len)
+	continue;
+      word_t v=next[len]++;
+      if (len<word_size && (v>>len)) {
+	throw std::logic_error("Invalid code lengths: "
+			       "too many codes of the same length");
+      }
+      word_t rev=0;
+      for(int i=0;i<len;++i)
+	rev |= ((v>>(len-1-i))&1)<<i;
+      codes[c]=code{rev,static_cast<std::uint8_t>(len)};
+    }
+    return codes;
+  }
 
+  inline void
+  to_prefixes(const code_table& codes,std::vector<prefix>& result)
+  {
+    result.clear();
+    for(int c=0;c<256;++c) {
+      if (codes[c].len) {
+	result.push_back(prefix{static_cast<std::uint8_t>(c),codes[c].len,
+				codes[c].bits});
+      }
+    }
+  }
 
-  void
-  trie::walk(node* root,const bits& pref, prefix_map& tbl)
+  inline std::vector<prefix>
+  to_prefixes(const code_table& codes)
+  {
+    std::vector<prefix> result;
+    to_prefixes(codes,result);
+    return result;
+  }
+
+  // Returns the exact size of the encoded text in bits.
+  inline std::uint64_t
+  encoded_bits(const frequences& freq,const code_table& codes)
   {
-    if (!root) {
-      throw std::logic_error("Fresh builded trie nil node walk");
+    std::uint64_t total=0;
+    for(int c=0;c<256;++c)
+      total += freq[c]*codes[c].len;
+    return total;
+  }
+
+  // Buffer size required by encode() for the given amount of bits.
+  inline std::size_t
+  encode_bound(std::uint64_t nbits)
+  {
+    return (nbits+word_size-1)/word_size*sizeof(word_t)+sizeof(word_t);
+  }
+  
+  // Code sources of encode(), the counterparts of order0_source and
+  // order1_source.
+  struct order0_codes {
+    const code_table* codes;
+    const code& operator()(std::uint8_t c) {
+      return (*codes)[c];
     }
-    if (!root->zero_link && !root->one_link) {
-      // It's a leaf with char
-      tbl[root->chr]=pref;
-    } else {
-      bits next(pref);
-      
-      next.push_back(0);
-      walk(root->zero_link,next,tbl);
-      
-      next.back()=1;
-      walk(root->one_link,next,tbl);
+  };
+
+  struct order1_codes {
+    const code_table* const* codes;
+    std::uint8_t prev;
+    const code& operator()(std::uint8_t c) {
+      const code& r=(*codes[prev])[c];
+      prev=c;
+      return r;
+    }
+  };
+  
+  template<typename SRC>
+  std::size_t
+  encode(const std::uint8_t* in,std::size_t size,SRC src,std::uint8_t* out)
+  {
+    bit_writer bin(out);
+    for(std::size_t i=0;i<size;++i) {
+      const code& c=src(in[i]);
+      bin.put(c.bits,c.len);
     }
+    return bin.finish();
   }
 
-  prefix_map
-  trie::to_map(node* prefixes)
+  inline std::size_t
+  encode(const std::uint8_t* in,std::size_t size,const code_table& codes,
+	 std::uint8_t* out)
   {
-    prefix_map tbl;
-    walk(prefixes,bits(),tbl);
-    return tbl;
+    return encode(in,size,order0_codes{&codes},out);
   }
   
-  prefix 
-  trie::find_char(node* r,std::bitset<word_size> bit_sequence,
-		  int bit_pos, int blen)
+  inline void
+  show_table(const std::vector<prefix>& tbl)
   {
-    
-    if (!r ) { 
-      throw std::logic_error("Invalid bits sequence in data: "
-			     "down to nil leaf (trie corrupted)");
-    }
-    if (bit_pos>blen) {
-      throw std::logic_error("Invalid bits sequence in data: too "
-			     "much bits in a prefix");
+    for(auto& e: tbl) {
+      int val=e.chr;
+      int len=e.plen;
+      std::cout<<std::hex<<val<<" "<<len<<" "
+	       <<std::bitset<word_size>(e.pref)<<std::endl;
     }
-    if ((r->zero_link==nullptr) && (r->one_link==nullptr)) {
-      prefix ret {r->chr,static_cast<std::uint8_t>(bit_pos),
-	  static_cast<word_t>(bit_sequence.to_ullong())};
-      
-      while(bit_pos<word_size) {
-	ret.set(bit_pos++,0);
+    
+  }
+  
+  // Byte histogram over four interleaved 32-bit sub-tables. A run of
+  // the same byte increments different counters, so increments do not
+  // wait for the previous store to the same counter. Sub-tables are
+  // summed into 64-bit counts before they can overflow.
+  inline void
+  count_frequence(const std::uint8_t* data,std::size_t size,
+		  frequences& frequence_table)
+  {
+    frequence_table.assign(256,0);
+    std::uint32_t sub[4][256];
+    while (size) {
+      std::size_t chunk=std::min<std::size_t>(size,std::size_t(1)<<30);
+      std::memset(sub,0,sizeof(sub));
+      const std::uint8_t* p=data;
+      const std::uint8_t* end=data+chunk;
+      for(;end-p>=16;p+=16) {
+	word_t a,b;
+	std::memcpy(&a,p,sizeof(a));
+	std::memcpy(&b,p+8,sizeof(b));
+	for(int shift=0;shift<word_size;shift+=32) {
+	  sub[0][(a>>shift)&0xff]++;
+	  sub[1][(a>>(shift+8))&0xff]++;
+	  sub[2][(a>>(shift+16))&0xff]++;
+	  sub[3][(a>>(shift+24))&0xff]++;
+	  sub[0][(b>>shift)&0xff]++;
+	  sub[1][(b>>(shift+8))&0xff]++;
+	  sub[2][(b>>(shift+16))&0xff]++;
+	  sub[3][(b>>(shift+24))&0xff]++;
+	}
       }
-      return ret;
-    } else {
-      if (bit_sequence[bit_pos]) 
-	return find_char(r->one_link,bit_sequence,bit_pos+1,blen);
-      else
-	return find_char(r->zero_link,bit_sequence,bit_pos+1,blen);
+      for(;p<end;++p)
+	sub[0][*p]++;
+      for(int c=0;c<256;++c)
+	frequence_table[c] += std::uint64_t(sub[0][c])+sub[1][c]+sub[2][c]+
+			      sub[3][c];
+      data += chunk;
+      size -= chunk;
     }
   }
 
-  class bin_stream {
+
+  // Reads little-endian fields from a memory buffer.
+  class mem_reader {
   public:
-    bin_stream(const std::string& st): stream(st),position(0),
-				       bits_count(0),so_far(0)
+    mem_reader(const std::uint8_t* data,std::size_t size): 
+      start(data),pos(data),end(data+size)
     {}
-    int get_bits(std::uint8_t sz,word_t& buf);
-    bool is_eof(void) {
-      return position>=stream.size();
+    template<typename T>
+    T get(void) {
+      T val;
+      std::memcpy(&val,skip(sizeof(val)),sizeof(val));
+      return val;
+    }
+    const std::uint8_t* skip(std::size_t n) {
+      if (static_cast<std::size_t>(end-pos)<n) {
+	throw std::logic_error("Unexpected end of compressed data");
+      }
+      auto p=pos;
+      pos += n;
+      return p;
+    }
+    void seek(std::size_t offset) {
+      pos=start;
+      skip(offset);
+    }
+    std::size_t left(void) const {
+      return end-pos;
     }
   private:
-    const std::string& stream;
-    std::string::size_type position;
-    int bits_count;
-    word_t so_far;
+    const std::uint8_t* start;
+    const std::uint8_t* pos;
+    const std::uint8_t* end;
   };
-  
-  // Should be changed to array of bytes. 
-  int
-  bin_stream::get_bits(std::uint8_t sz,word_t& buf)
+
+  template<typename T>
+  void
+  put(std::vector<std::uint8_t>& out,T val)
   {
-    if (sz>word_size) sz=word_size;
-    
-    int readed=0;
-    buf=0;
-    
-    while (sz>0 && (position<stream.size() || bits_count)) {
-      if (bits_count>=sz) {
-	if (sz==word_size) {
-	  buf=so_far;
-	  so_far=0;
-	} else {
-	  buf |= (so_far & (~(-1LL<<sz)))<<readed;
-	  so_far >>=sz;
-	}
-	bits_count -=sz;
-	readed +=sz;
-	return readed;
-      } else if (bits_count>0) { // sz > bits_count
-	buf |=so_far<<readed;
-	readed +=bits_count;
-	sz -= bits_count;
-	so_far=0;
-	bits_count=0;
-      }
-      if (position<stream.size()) {
-	int bytes_read=0;
-	while((bytes_read<8) && (position<stream.size())) {
-	  so_far |=(0xff & static_cast<word_t>(stream[position++]))
-		    <<(bytes_read*(word_size/8));
-	  bytes_read++;
-	}
-	bits_count=bytes_read*(word_size/8);
-      }
-    }
-    return readed;
+    auto at=out.size();
+    out.resize(at+sizeof(val));
+    std::memcpy(&out[at],&val,sizeof(val));
   }
 
-  template<typename FUNC>
-  void 
-  trie::decode(const std::string& text,FUNC& f,int padding_bits) 
+  // Block body starts with its type. A Huffman block keeps the number
+  // of code lengths, code lengths and the bits. An interleaved block
+  // has the same table followed by sizes of the first three streams
+  // and four streams, one per quarter of the text. A context block
+  // codes every symbol with a table chosen by the previous one: it
+  // keeps the shared table, a bitmap of contexts which have their own
+  // table and those tables, then the streams as the Huffman blocks do.
+  // A stored block is used when coding does not make the block smaller.
+  enum block_type: std::uint8_t { huffman_block=0, stored_block=1,
+				  huffman4_block=2, context_block=3,
+				  context4_block=4 };
+
+  // Number of stored code lengths: up to the last used symbol.
+  inline std::uint16_t
+  lengths_count(const code_lengths& lens)
   {
-    
-    std::bitset<word_size> current_word(0);
-    std::uint8_t bits_so_far=0;
-    word_t next_bits=0;
-    
-    bin_stream bits_stream(text);
-    for(;;) {
-      int read_len;
-      if (bits_so_far<word_size) {
-	int read_len=bits_stream.get_bits(word_size-bits_so_far,
-					  next_bits);
-	if (read_len>0) {
-	  next_bits <<=bits_so_far;
-	  current_word |=next_bits;
-	  bits_so_far+=read_len;
-	} 
-      }
-      if (bits_so_far==0 || (bits_stream.is_eof() && 
-          bits_so_far==padding_bits))
-	break;
-      
-      prefix chr=find(current_word,bits_so_far);
-      f(chr.chr);
-      
-      current_word >>=chr.plen;
-      bits_so_far -=chr.plen;
+    std::uint16_t nsyms=256;
+    while (nsyms>0 && !lens[nsyms-1])
+      nsyms--;
+    return nsyms;
+  }
+  
+  inline void
+  put_lengths(std::vector<std::uint8_t>& body,const code_lengths& lens)
+  {
+    std::uint16_t nsyms=lengths_count(lens);
+    put(body,nsyms);
+    body.insert(body.end(),lens.begin(),lens.begin()+nsyms);
+  }
+  
+  // Writes the text as one stream or as four streams preceded by sizes
+  // of the first three. encode_part(in,size,out) codes a part and
+  // returns its length in bytes, nbits is the length of all parts.
+  template<typename ENC>
+  void
+  put_streams(std::vector<std::uint8_t>& body,const std::uint8_t* in,
+	      std::size_t size,std::uint64_t nbits,bool interleaved,
+	      ENC encode_part)
+  {
+    const int n= interleaved ? 4 : 1;
+    auto at=body.size();
+    std::size_t sizes_len=(n-1)*sizeof(std::uint32_t);
+    // Streams are written one after another, a stream may store a
+    // word past its end which the next one overwrites.
+    body.resize(at+sizes_len+encode_bound(nbits)+n*sizeof(word_t));
+    std::size_t part=size/n,pos=at+sizes_len;
+    for(int k=0;k<n;++k) {
+      auto len=encode_part(in+k*part,k<n-1 ? part : size-(n-1)*part,
+			   &body[pos]);
+      if (k<n-1) {
+	std::uint32_t len32=len;
+	std::memcpy(&body[at+k*sizeof(len32)],&len32,sizeof(len32));
+      }
+      pos += len;
     }
+    body.resize(pos);
   }
 
-
-  class bin_writer {
+  // Codes blocks with a single table or with order-1 context tables,
+  // whichever is smaller. A context gets its own table only when the
+  // table pays for itself. Work tables are kept between blocks, so a
+  // coder which is reused does not allocate once the body has grown.
+  class block_encoder {
   public:
-    bin_writer(std::ofstream& fl): file(fl),current_byte(8,0),
-			           bits_collected(0)
+    block_encoder(): pairs(256*256,0),context_lens(256),row(256),
+		     context_codes(256)
     {}
-    void write(const std::vector<std::uint8_t>& bits);
-    void write_bit(std::uint8_t bit) {
-      current_byte[bits_collected++]=bit;
-      if (is_full()) {
-	flash();
+    void encode(const std::uint8_t* in,std::size_t size,
+		std::vector<std::uint8_t>& body,bool interleaved);
+  private:
+    frequences freq;
+    std::vector<std::uint32_t> pairs;
+    std::vector<code_lengths> context_lens;
+    frequences row;
+    std::vector<code_table> context_codes;
+  };
+
+  inline void
+  block_encoder::encode(const std::uint8_t* in,std::size_t size,
+			std::vector<std::uint8_t>& body,bool interleaved)
+  {
+    const int n= interleaved ? 4 : 1;
+    const std::size_t part=size/n;
+    count_frequence(in,size,freq);
+    auto lens = huffman_lengths(freq,max_code_len);
+    auto codes = canonical_codes(lens);
+    auto nbits = encoded_bits(freq,codes);
+    std::size_t table_len=sizeof(std::uint16_t)+lengths_count(lens);
+    std::size_t sizes_len=(n-1)*sizeof(std::uint32_t);
+
+    // Pairs are counted as they are coded: the first symbol of a
+    // stream follows 0. Only counters of the pairs seen are cleared
+    // afterwards, so a short block does not pay for the whole table.
+    auto each_pair=[&](auto f) {
+      for(int k=0;k<n;++k) {
+	std::uint8_t prev=0;
+	std::size_t end= k<n-1 ? (k+1)*part : size;
+	for(std::size_t i=k*part;i<end;++i) {
+	  f(prev,in[i]);
+	  prev=in[i];
+	}
+      }
+    };
+    std::array<std::uint64_t,256> totals{};
+    each_pair([&](std::uint8_t p,std::uint8_t c) {
+	pairs[p*256+c]++;
+	totals[p]++;
+      });
+    std::bitset<256> own;
+    std::uint64_t context_bits=0;
+    std::size_t context_len=table_len+own.size()/8;
+    for(int p=0;p<256;++p) {
+      std::uint64_t total=totals[p],shared_bits=0,own_bits=0;
+      if (!total)
+	continue;
+      for(int c=0;c<256;++c) {
+	row[c]=pairs[p*256+c];
+	shared_bits += row[c]*lens[c];
+      }
+      // Entropy is a lower bound of the own table bits, most contexts
+      // which do not pay off are rejected without building codes.
+      double entropy=0;
+      int last=0;
+      for(int c=0;c<256;++c) {
+	if (row[c]) {
+	  entropy += row[c]*std::log2(double(total)/row[c]);
+	  last=c;
+	}
+      }
+      std::size_t own_len=sizeof(std::uint16_t)+last+1;
+      if (entropy+8*own_len>=shared_bits) {
+	context_bits += shared_bits;
+	continue;
+      }
+      auto ctx=huffman_lengths(row,max_code_len);
+      for(int c=0;c<256;++c)
+	own_bits += row[c]*ctx[c];
+      if (own_bits+8*own_len<shared_bits) {
+	own.set(p);
+	context_lens[p]=ctx;
+	context_bits += own_bits;
+	context_len += own_len;
+      } else {
+	context_bits += shared_bits;
       }
     }
-    bool is_full(void) {
-      return bits_collected>=8;
+    each_pair([&](std::uint8_t p,std::uint8_t c) {
+	pairs[p*256+c]=0;
+      });
+
+    std::size_t order0_size=table_len+sizes_len+(nbits+7)/8;
+    std::size_t order1_size=context_len+sizes_len+(context_bits+7)/8;
+    body.clear();
+    if (std::min(order0_size,order1_size)>=size) {
+      put(body,stored_block);
+      body.insert(body.end(),in,in+size);
+      return;
     }
-    int write_tail(void) {
-      int have_bits=bits_collected;
-      if (have_bits) {
-	flash(); 
+    if (order0_size<=order1_size) {
+      put(body,interleaved ? huffman4_block : huffman_block);
+      put_lengths(body,lens);
+      put_streams(body,in,size,nbits,interleaved,
+		  [&](const std::uint8_t* p,std::size_t len,std::uint8_t* out) {
+		    return pack::encode(p,len,codes,out);
+		  });
+      return;
+    }
+    
+    put(body,interleaved ? context4_block : context_block);
+    put_lengths(body,lens);
+    std::array<std::uint8_t,32> bitmap{};
+    const code_table* tables[256];
+    for(int p=0,j=0;p<256;++p) {
+      tables[p]=&codes;
+      if (own[p]) {
+	bitmap[p/8] |= 1<<(p%8);
+	context_codes[j]=canonical_codes(context_lens[p]);
+	tables[p]=&context_codes[j++];
       }
-      return 8-have_bits;
     }
-    ~bin_writer() {
-      write_tail();
+    put(body,bitmap);
+    for(int p=0;p<256;++p) {
+      if (own[p])
+	put_lengths(body,context_lens[p]);
     }
-  private:
-    void clear(void) {
-      for(auto& p: current_byte)
-      p=0;
-      bits_collected=0;
-    }
-    void flash(void);
-    std::uint8_t get_byte(void) {
-      std::bitset<8> byte;
-      for(int i=0;i<current_byte.size();++i)
-	byte[i]=current_byte[i];
-      return byte.to_ulong() & 0xff;
-    }
-    std::ofstream& file;
-    bits current_byte;
-    int bits_collected;
-  };
+    put_streams(body,in,size,context_bits,interleaved,
+		[&](const std::uint8_t* p,std::size_t len,std::uint8_t* out) {
+		  return pack::encode(p,len,order1_codes{tables,0},out);
+		});
+  }
 
+  // Code lengths part of a Huffman block or of the version 1 file.
+  inline code_table
+  read_lengths(mem_reader& in)
+  {
+    auto nsyms=in.get<std::uint16_t>();
+    if (nsyms>256)
+      throw std::logic_error("Invalid code lengths table size");
+    code_lengths lens{};
+    std::memcpy(&lens[0],in.skip(nsyms),nsyms);
+    return canonical_codes(lens);
+  }
 
-  void
-  bin_writer::write(const std::vector<uint8_t>& bits) 
+  // Splits the rest of the body into streams, returns their number.
+  inline int
+  read_streams(mem_reader& in,bool interleaved,bit_reader* streams)
   {
-    for(int i=0;i<bits.size();++i) {
-      write_bit(bits[i]);
+    const int n= interleaved ? 4 : 1;
+    std::size_t sizes[4];
+    for(int k=0;k<n-1;++k)
+      sizes[k]=in.get<std::uint32_t>();
+    sizes[n-1]=0;
+    for(int k=0;k<n;++k) {
+      if (k==n-1)
+	sizes[k]=in.left();
+      streams[k]=bit_reader(in.skip(sizes[k]),sizes[k]);
     }
+    return n;
   }
-  
+
+  template<typename SRC>
   void
-  bin_writer::flash(void)
+  decode_with(SRC src,mem_reader& in,bool interleaved,std::uint8_t* out,
+	      std::size_t out_size,int per_refill)
   {
-    std::uint8_t chr=get_byte();
-    file.write((char*)&chr,1);
-    clear();
+    bit_reader streams[4];
+    SRC sources[4]={src,src,src,src};
+    if (read_streams(in,interleaved,streams)==1)
+      decode_streams<1>(sources,streams,out,out_size,per_refill);
+    else
+      decode_streams<4>(sources,streams,out,out_size,per_refill);
   }
   
+  // Decodes blocks with the tables kept between blocks.
+  class block_decoder {
+  public:
+    void decode(const std::uint8_t* body,std::size_t size,
+		std::uint8_t* out,std::size_t out_size);
+  private:
+    void build(decode_table& table,mem_reader& in) {
+      to_prefixes(read_lengths(in),prefixes);
+      table.build(prefixes);
+    }
+    decode_table shared;
+    std::vector<decode_table> own;
+    std::vector<prefix> prefixes;
+  };
+  
+  inline void
+  block_decoder::decode(const std::uint8_t* body,std::size_t size,
+			std::uint8_t* out,std::size_t out_size)
+  {
+    mem_reader in(body,size);
+    auto type=in.get<block_type>();
+    if (type==stored_block) {
+      if (in.left()!=out_size)
+	throw std::logic_error("Invalid stored block size");
+      std::memcpy(out,in.skip(out_size),out_size);
+    } else if (type==huffman_block || type==huffman4_block) {
+      build(shared,in);
+      decode_with(order0_source{&shared},in,type==huffman4_block,
+		  out,out_size,shared.per_refill());
+    } else if (type==context_block || type==context4_block) {
+      build(shared,in);
+      auto bitmap=in.get<std::array<std::uint8_t,32>>();
+      std::size_t nown=0;
+      for(int p=0;p<256;++p)
+	nown += (bitmap[p/8]>>(p%8))&1;
+      if (own.size()<nown)
+	own.resize(nown);
+      const decode_table* tables[256];
+      int per_refill=shared.per_refill();
+      for(int p=0,j=0;p<256;++p) {
+	tables[p]=&shared;
+	if ((bitmap[p/8]>>(p%8))&1) {
+	  build(own[j],in);
+	  per_refill=std::min(per_refill,own[j].per_refill());
+	  tables[p]=&own[j++];
+	}
+      }
+      decode_with(order1_source{tables,0},in,type==context4_block,
+		  out,out_size,per_refill);
+    } else {
+      throw std::logic_error("Unknown block type");
+    }
+  }
+
+
+  // Runs job(i) for every i in [0,n) on up to threads threads. The
+  // first exception thrown by a job stops the rest and is rethrown.
+  template<typename JOB>
   void
-  vector2bits(std::uint8_t chr,const bits& code, prefix& ent)
+  parallel_for(std::size_t n,int threads,JOB job)
   {
-    ent.chr=chr;
-    ent.plen=code.size();
-    ent.pref=0;
-    for(int i=0;i<code.size();++i)
-      ent.set(i,code[i]);
+    std::atomic<std::size_t> next(0);
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto work=[&]() {
+      for(std::size_t i=next++;i<n;i=next++) {
+	try {
+	  job(i);
+	} catch (...) {
+	  std::lock_guard<std::mutex> lock(error_lock);
+	  if (!error)
+	    error=std::current_exception();
+	  next=n;
+	}
+      }
+    };
+    std::vector<std::thread> workers;
+    for(std::size_t t=1;t<static_cast<std::size_t>(threads) && t<n;++t)
+      workers.emplace_back(work);
+    work();
+    for(auto& w: workers)
+      w.join();
+    if (error)
+      std::rethrow_exception(error);
   }
-  
-  std::vector<prefix>
-  save_table(const prefix_map& tbl) 
+
+  // CRC-32C (Castagnoli) by eight bytes at once: table k gives the
+  // remainder of a byte followed by k zero bytes. SSE4.2 has an
+  // instruction for it. crc continues the checksum of the preceding
+  // data.
+  inline std::uint32_t
+  crc32c(const std::uint8_t* data,std::size_t size,std::uint32_t crc=0)
   {
-    std::vector<prefix> result;
-    for(auto& p: tbl) {
-      result.emplace_back(prefix());
-      vector2bits(p.first,p.second,result.back());
+#ifdef __SSE4_2__
+    word_t acc=~crc;
+    for(;size>=sizeof(word_t);data+=sizeof(word_t),size-=sizeof(word_t)) {
+      word_t w;
+      std::memcpy(&w,data,sizeof(w));
+      acc=_mm_crc32_u64(acc,w);
     }
-    return result;
+    crc=acc;
+    for(;size;--size)
+      crc=_mm_crc32_u8(crc,*data++);
+    return ~crc;
+#else
+    static const auto tables=[]() {
+      std::array<std::array<std::uint32_t,256>,8> t;
+      for(std::uint32_t c=0;c<256;++c) {
+	std::uint32_t r=c;
+	for(int k=0;k<8;++k)
+	  r=(r>>1)^(0x82f63b78 & (0u-(r&1)));
+	t[0][c]=r;
+      }
+      for(int k=1;k<8;++k) {
+	for(int c=0;c<256;++c)
+	  t[k][c]=(t[k-1][c]>>8)^t[0][t[k-1][c]&0xff];
+      }
+      return t;
+    }();
+    crc=~crc;
+    for(;size>=sizeof(word_t);data+=sizeof(word_t),size-=sizeof(word_t)) {
+      word_t w;
+      std::memcpy(&w,data,sizeof(w));
+      w ^= crc;
+      crc=tables[7][w&0xff]^tables[6][(w>>8)&0xff]^
+	tables[5][(w>>16)&0xff]^tables[4][(w>>24)&0xff]^
+	tables[3][(w>>32)&0xff]^tables[2][(w>>40)&0xff]^
+	tables[1][(w>>48)&0xff]^tables[0][w>>56];
+    }
+    for(;size;--size)
+      crc=(crc>>8)^tables[0][(crc^*data++)&0xff];
+    return ~crc;
+#endif
   }
-  
-  void
-  show_table(const std::vector<prefix>& tbl)
+
+  // Checksum of a version 3 frame covers its lengths and the body.
+  inline std::uint32_t
+  frame_checksum(std::uint32_t raw_len,std::uint32_t body_len,
+		 const std::uint8_t* body)
   {
-    for(auto& e: tbl) {
-      int val=e.chr;
-      int len=e.plen;
-      std::cout<<std::hex<<val<<" "<<len<<" "
-	       <<std::bitset<word_size>(e.pref)<<std::endl;
+    std::uint32_t hdr[2]={raw_len,body_len};
+    return crc32c(body,body_len,
+		  crc32c(reinterpret_cast<std::uint8_t*>(hdr),sizeof(hdr)));
+  }
+
+  // Length of the frame header: version 3 adds the checksum.
+  inline std::size_t
+  frame_header_len(char version)
+  {
+    return (version>=3 ? 3 : 2)*sizeof(std::uint32_t);
+  }
+
+  // Length of the trailer: version 3 adds the checksum of the index
+  // and of the trailer itself.
+  inline std::size_t
+  trailer_len(char version)
+  {
+    return 2*sizeof(std::uint64_t)+(version>=3 ? sizeof(std::uint32_t) : 0);
+  }
+
+  // Block containers: block size, frames of (original length, body
+  // length, [checksum,] body), an empty frame, offsets of the frames
+  // and at last the offset of the index, the original length and [the
+  // checksum of the index and the trailer]. Checksums are there since
+  // version 3. The data should outlive the index.
+  class block_index {
+  public:
+    void read(const std::uint8_t* data,std::size_t size);
+    std::uint64_t original_size(void) const {
+      return original_len;
+    }
+    std::size_t blocks(void) const {
+      return offsets.size();
     }
+    std::uint32_t block_bytes(void) const {
+      return bsize;
+    }
+    // Decodes the part of block i which falls into [from,from+size) of
+    // the text to out, the start of that range. A block which is cut by
+    // the range is decoded into scratch first.
+    void decode(std::size_t i,std::uint64_t from,std::uint64_t size,
+		std::uint8_t* out,block_decoder& coder,
+		std::vector<std::uint8_t>& scratch) const;
+    // Checks the frames of blocks [first,last) before the output is
+    // allocated, so a damaged length can not ask for more output than
+    // the bodies can hold.
+    void check(std::size_t first,std::size_t last) const;
+  private:
+    struct frame {
+      std::uint32_t raw_len;
+      std::uint32_t body_len;
+      std::uint32_t checksum;
+      const std::uint8_t* body;
+    };
+    // Every byte of a block takes at least one bit of its body.
+    frame frame_of(std::size_t i) const;
+    const std::uint8_t* data=nullptr;
+    char version=0;
+    std::uint64_t index_pos=0;
+    std::uint64_t original_len=0;
+    std::uint32_t bsize=0;
+    std::vector<std::uint64_t> offsets;
+  };
+
+  inline void
+  block_index::read(const std::uint8_t* src,std::size_t size)
+  {
+    mem_reader in(src,size);
+    auto magic=in.get<std::array<char,3>>();
+    if (magic[0]!='H' || magic[1]!='C' || magic[2]<2 || magic[2]>3)
+      throw std::logic_error("Unsupported format version");
+    version=magic[2];
+    bsize=in.get<std::uint32_t>();
     
+    const std::size_t trailer=trailer_len(version);
+    if (size<trailer)
+      throw std::logic_error("Unexpected end of compressed data");
+    in.seek(size-trailer);
+    index_pos=in.get<std::uint64_t>();
+    original_len=in.get<std::uint64_t>();
+    if (index_pos>size-trailer || bsize==0)
+      throw std::logic_error("Invalid block index");
+    if (version>=3 &&
+	in.get<std::uint32_t>()!=crc32c(src+index_pos,
+					size-sizeof(std::uint32_t)-index_pos))
+      throw std::logic_error("Block index is corrupted: checksum mismatch");
+    std::size_t nblocks=(size-trailer-index_pos)/sizeof(std::uint64_t);
+    if (nblocks!=(original_len+bsize-1)/bsize)
+      throw std::logic_error("Invalid block index");
+
+    in.seek(index_pos);
+    offsets.resize(nblocks);
+    for(auto& offset: offsets)
+      offset=in.get<std::uint64_t>();
+    data=src;
   }
-  
-  std::vector<int>
-  count_frequence(const std::string& text) 
+
+  inline block_index::frame
+  block_index::frame_of(std::size_t i) const
+  {
+    mem_reader in(data,index_pos);
+    in.seek(offsets[i]);
+    frame f;
+    f.raw_len=in.get<std::uint32_t>();
+    f.body_len=in.get<std::uint32_t>();
+    f.checksum= version>=3 ? in.get<std::uint32_t>() : 0;
+    if (f.raw_len!=std::min<std::uint64_t>(bsize,original_len-i*bsize) ||
+	f.raw_len>8*std::uint64_t(f.body_len))
+      throw std::logic_error("Invalid block length");
+    f.body=in.skip(f.body_len);
+    return f;
+  }
+
+  inline void
+  block_index::check(std::size_t first,std::size_t last) const
   {
-    std::vector<int> frequence_table(256,0);
-    for(char c: text) {
-      frequence_table[static_cast<unsigned char>(c)]++;
+    for(std::size_t i=first;i<last;++i)
+      frame_of(i);
+  }
+
+  inline void
+  block_index::decode(std::size_t i,std::uint64_t from,std::uint64_t size,
+		      std::uint8_t* out,block_decoder& coder,
+		      std::vector<std::uint8_t>& scratch) const
+  {
+    auto [raw_len,body_len,checksum,body]=frame_of(i);
+    if (version>=3 && checksum!=frame_checksum(raw_len,body_len,body)) {
+      throw std::logic_error("Block "+std::to_string(i)+
+			     " is corrupted: checksum mismatch");
+    }
+    
+    std::uint64_t start=std::uint64_t(i)*bsize;
+    std::uint64_t first=std::max(start,from);
+    std::uint64_t last=std::min(start+raw_len,from+size);
+    if (first==start && last==start+raw_len) {
+      coder.decode(body,body_len,out+(start-from),raw_len);
+    } else if (first<last) {
+      scratch.resize(raw_len);
+      coder.decode(body,body_len,scratch.data(),raw_len);
+      std::memcpy(out+(first-from),scratch.data()+(first-start),last-first);
     }
-    return frequence_table;
   }
-  
 
+  // In-memory compression of buffers into the block container, the
+  // same bytes compress() writes for a file. An encoder keeps its work
+  // tables and buffers between calls, so many small messages are coded
+  // without allocations once the first ones have been done.
+  class encoder {
+  public:
+    explicit encoder(bool interleaved=false): interleaved(interleaved)
+    {}
+    // Largest output of compress() for size bytes.
+    static std::size_t bound(std::size_t size);
+    // Returns the number of bytes written to out.
+    std::size_t compress(std::span<const std::uint8_t> in,
+			 std::span<std::uint8_t> out);
+  private:
+    block_encoder coder;
+    std::vector<std::uint8_t> body;
+    std::vector<std::uint64_t> index;
+    bool interleaved;
+  };
+
+  inline std::size_t
+  encoder::bound(std::size_t size)
+  {
+    // A body is coded only when the estimate is shorter than the block,
+    // rounding of the four streams adds up to 3 bytes to it. A stored
+    // body is one byte longer than the block.
+    const std::size_t frame=frame_header_len(format_version)+4+
+      sizeof(std::uint64_t);
+    std::size_t nblocks=(size+block_size-1)/block_size;
+    return 3+sizeof(std::uint32_t)+size+nblocks*frame+
+      frame_header_len(format_version)+trailer_len(format_version);
+  }
+
+  inline std::size_t
+  encoder::compress(std::span<const std::uint8_t> in,
+		    std::span<std::uint8_t> out)
+  {
+    std::size_t pos=0;
+    auto write=[&](const void* p,std::size_t n) {
+      if (out.size()-pos<n)
+	throw std::logic_error("Output buffer is too small");
+      std::memcpy(out.data()+pos,p,n);
+      pos += n;
+    };
+    const char magic[3]={'H','C',format_version};
+    write(magic,sizeof(magic));
+    write(&block_size,sizeof(block_size));
+    
+    index.clear();
+    for(std::size_t at=0;at<in.size();at+=block_size) {
+      std::uint32_t raw_len=std::min<std::size_t>(block_size,in.size()-at);
+      coder.encode(in.data()+at,raw_len,body,interleaved);
+      std::uint32_t body_len=body.size();
+      std::uint32_t hdr[3]={raw_len,body_len,
+			    frame_checksum(raw_len,body_len,body.data())};
+      index.push_back(pos);
+      write(hdr,sizeof(hdr));
+      write(body.data(),body_len);
+    }
+    
+    std::uint32_t end[3]={0,0,0};
+    write(end,sizeof(end));
+    std::uint64_t index_pos=pos;
+    std::uint64_t trailer[2]={index_pos,in.size()};
+    if (!index.empty())
+      write(index.data(),index.size()*sizeof(index[0]));
+    write(trailer,sizeof(trailer));
+    std::uint32_t checksum=crc32c(out.data()+index_pos,pos-index_pos);
+    write(&checksum,sizeof(checksum));
+    return pos;
+  }
+
+  // In-memory decompression of buffers made by encoder or by
+  // compress(). The decoding tables are kept between calls.
+  class decoder {
+  public:
+    // Length of the data compressed into the buffer.
+    std::uint64_t original_size(std::span<const std::uint8_t> in) {
+      index.read(in.data(),in.size());
+      return index.original_size();
+    }
+    // Returns the number of bytes written to out.
+    std::size_t decompress(std::span<const std::uint8_t> in,
+			   std::span<std::uint8_t> out);
+    // Decodes out.size() bytes of the text from the offset on, only the
+    // blocks which hold them. Returns the number of bytes written, which
+    // is less at the end of the text.
+    std::size_t decompress(std::span<const std::uint8_t> in,
+			   std::uint64_t offset,std::span<std::uint8_t> out);
+  private:
+    // Decoding of the range with the index already read.
+    std::size_t decode_range(std::uint64_t offset,std::span<std::uint8_t> out);
+
+    block_index index;
+    block_decoder coder;
+    std::vector<std::uint8_t> scratch;
+  };
+
+  inline std::size_t
+  decoder::decompress(std::span<const std::uint8_t> in,
+		      std::span<std::uint8_t> out)
+  {
+    index.read(in.data(),in.size());
+    if (out.size()<index.original_size())
+      throw std::logic_error("Output buffer is too small");
+    return decode_range(0,out);
+  }
+
+  inline std::size_t
+  decoder::decompress(std::span<const std::uint8_t> in,
+		      std::uint64_t offset,std::span<std::uint8_t> out)
+  {
+    index.read(in.data(),in.size());
+    return decode_range(offset,out);
+  }
+
+  inline std::size_t
+  decoder::decode_range(std::uint64_t offset,std::span<std::uint8_t> out)
+  {
+    auto len=index.original_size();
+    std::uint64_t size= offset<len ? std::min<std::uint64_t>(out.size(),
+							     len-offset) : 0;
+    if (!size)
+      return 0;
+    auto bsize=index.block_bytes();
+    for(std::size_t i=offset/bsize;i<(offset+size+bsize-1)/bsize;++i)
+      index.decode(i,offset,size,out.data(),coder,scratch);
+    return size;
+  }
   
 };  
   
+// The pack namespace is the library: its functions are inline, so
+// the file can be included into several units. The tool below is left
+// out when PACK_NO_MAIN is defined.
+#ifndef PACK_NO_MAIN
 using namespace pack;
 
-std::string
-read_file(const std::string& file_in)
+// "-" stands for the standard input and output. Streams fail only on
+// I/O errors, short reads are checked with gcount().
+std::istream&
+open_input(const std::string& name,std::ifstream& file)
 {
-  std::ifstream in;
-  in.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-  in.open(file_in, std::ios::ate);
+  if (name=="-") {
+    std::cin.exceptions(std::ios::badbit);
+    return std::cin;
+  }
+  file.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+  file.open(name);
+  file.exceptions(std::ios::badbit);
+  return file;
+}
 
-  auto len = in.tellg();
-  in.seekg (0, in.beg);
-  
-  std::string txt(len,0);
-  in.read(&txt[0],len);
-  return txt;
+std::ostream&
+open_output(const std::string& name,std::ofstream& file)
+{
+  if (name=="-") {
+    std::cout.exceptions(std::ios::failbit | std::ios::badbit);
+    return std::cout;
+  }
+  file.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
+  file.open(name);
+  return file;
 }
 
+bool
+is_regular(const std::string& name)
+{
+  struct stat st;
+  return name!="-" && stat(name.c_str(),&st)==0 && S_ISREG(st.st_mode);
+}
+
+std::size_t
+read_some(std::istream& in,void* buf,std::size_t size)
+{
+  in.read(static_cast<char*>(buf),size);
+  return in.gcount();
+}
 
-class char_writer {
+
+// Whole regular file mapped into memory: read-only for an existing
+// file or read-write for a file created with the given size.
+class mapped_file {
 public:
-  char_writer(std::ofstream& o, std::streamoff original_len): 
-					out(o),olen(original_len)
+  mapped_file(): addr(nullptr),len(0)
   {}
-  void operator()(std::uint8_t chr) {
-    out.write(reinterpret_cast<char*>(&chr),1);
+  mapped_file(const mapped_file&)=delete;
+  mapped_file& operator=(const mapped_file&)=delete;
+  ~mapped_file() {
+    if (addr)
+      munmap(addr,len);
+  }
+  void open(const std::string& name) {
+    map(name,::open(name.c_str(),O_RDONLY),0,false);
+  }
+  void create(const std::string& name,std::uint64_t size) {
+    map(name,::open(name.c_str(),O_RDWR|O_CREAT|O_TRUNC,0666),size,true);
+  }
+  std::uint8_t* data(void) const {
+    return static_cast<std::uint8_t*>(addr);
+  }
+  std::size_t size(void) const {
+    return len;
   }
 private:
-  std::ofstream& out;
-  std::streamoff olen;
+  void map(const std::string& name,int fd,std::uint64_t size,bool writable);
+  void* addr;
+  std::size_t len;
 };
 
+void
+mapped_file::map(const std::string& name,int fd,std::uint64_t size,
+		 bool writable)
+{
+  if (fd<0)
+    throw std::runtime_error(name+": "+std::strerror(errno));
+  struct stat st;
+  if (writable ? ftruncate(fd,size)!=0 : fstat(fd,&st)!=0) {
+    int err=errno;
+    close(fd);
+    throw std::runtime_error(name+": "+std::strerror(err));
+  }
+  len = writable ? size : st.st_size;
+  if (len) {
+    addr=mmap(nullptr,len,writable ? PROT_READ|PROT_WRITE : PROT_READ,
+	      MAP_SHARED,fd,0);
+    if (addr==MAP_FAILED) {
+      int err=errno;
+      addr=nullptr;
+      close(fd);
+      throw std::runtime_error(name+": "+std::strerror(err));
+    }
+  }
+  close(fd);
+}
 
+// Destination of decompressed data. The length is known from the
+// header, so a regular output file is created of that size and
+// decoded into directly. Otherwise the data is collected in memory
+// and written by commit().
+class output_buffer {
+public:
+  // Without a name the data is kept in memory.
+  output_buffer()
+  {}
+  output_buffer(const std::string& file_out): name(file_out)
+  {}
+  std::uint8_t* allocate(std::uint64_t size) {
+    struct stat st;
+    if (!name.empty() && name!="-" &&
+	(stat(name.c_str(),&st)!=0 || S_ISREG(st.st_mode))) {
+      file.create(name,size);
+      mapped=true;
+      return file.data();
+    }
+    buf.resize(size);
+    return buf.data();
+  }
+  const std::vector<std::uint8_t>& data(void) const {
+    return buf;
+  }
+  void commit(void) {
+    if (mapped || name.empty())
+      return;
+    std::ofstream fout;
+    auto& of=open_output(name,fout);
+    of.write(reinterpret_cast<char*>(buf.data()),buf.size());
+    of.flush();
+  }
+private:
+  std::string name;
+  mapped_file file;
+  std::vector<std::uint8_t> buf;
+  bool mapped=false;
+};
+
+// Every symbol takes at least the shortest code, so size bytes of
+// bits can not hold more than 8*size/shortest symbols. A damaged
+// length would otherwise allocate the output before the decoding
+// finds the stream too short.
 void
-decompress(const std::string& file_in, const std::string& file_out, 
-	   bool verbose)
+check_length(const std::vector<prefix>& table,std::uint64_t original_len,
+	     std::size_t size)
 {
-  
-  std::ifstream in;
-  in.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-  in.open(file_in);
-  
-  
-  
-  if (in.get()!='H' || in.get()!='M')
-    throw std::logic_error("No magic number in the source file");
-  
-  std::streamoff original_len=0;
-  in.read(reinterpret_cast<char*>(&original_len),sizeof(original_len));
-  
-  
+  int shortest=0;
+  for(auto& p: table) {
+    if (p.plen && (!shortest || p.plen<shortest))
+      shortest=p.plen;
+  }
+  if (shortest && original_len>8*std::uint64_t(size)/shortest)
+    throw std::logic_error("Invalid original length");
+}
 
-  if (original_len==0)
+// Old "HM" container: the prefix structs are stored as is.
+void
+decompress_legacy(mem_reader& in,output_buffer& result,bool verbose)
+{
+  auto original_len=in.get<std::streamoff>();
+  if (original_len<0)
+    throw std::logic_error("Invalid original length");
+  if (original_len==0) {
+    result.allocate(0);
     return;
+  }
   
-  int table_sz=0;
-  in.read(reinterpret_cast<char*>(&table_sz),sizeof(table_sz));
-  
-  
+  auto table_sz=in.get<int>();
+  if (table_sz<0 || table_sz%sizeof(prefix))
+    throw std::logic_error("Invalid prefix table size");
 
-  std::uint16_t padding=0;
-  in.read(reinterpret_cast<char*>(&padding),sizeof(padding));
+  // The padding is not needed anymore: decoding stops after
+  // original_len symbols.
+  in.get<std::uint16_t>();
   
   std::vector<prefix> table(table_sz/sizeof(prefix),prefix());
-  in.read(reinterpret_cast<char*>(&table[0]),table_sz);
+  std::memcpy(table.data(),in.skip(table_sz),table_sz);
 
   if (verbose)
     show_table(table);
 	  
-  trie symbols;
-  symbols.from_vector(table);
+  decode_table symbols;
+  symbols.build(table);
   
-  auto data_pos = in.tellg();
-  in.seekg (0, in.end);
-  auto end_pos = in.tellg();
-  in.seekg (data_pos,in.beg);
+  check_length(table,original_len,in.left());
+  auto out=result.allocate(original_len);
+  auto left=in.left();
+  symbols.decode(in.skip(left),left,out,original_len);
+}
+
+// Version 1: original length, code lengths and the bits.
+void
+decompress_single(mem_reader& in,output_buffer& result,bool verbose)
+{
+  auto original_len=in.get<std::uint64_t>();
+  auto codes=read_lengths(in);
+  auto table=to_prefixes(codes);
+  
+  if (verbose)
+    show_table(table);
+
+  check_length(table,original_len,in.left());
+  auto out=result.allocate(original_len);
+  if (original_len) {
+    decode_table symbols;
+    symbols.build(table);
+    auto left=in.left();
+    symbols.decode(in.skip(left),left,out,original_len);
+  }
+}
 
+// Part of the text to decompress: count bytes from the offset on.
+struct text_range {
+  std::uint64_t offset=0;
+  std::uint64_t count=UINT64_MAX;
+  bool whole(void) const {
+    return offset==0 && count==UINT64_MAX;
+  }
+};
 
-  std::string txt(end_pos-data_pos,0);
-  in.read(&txt[0],end_pos-data_pos);
+// Versions 2 and 3: blocks are found through the index and decoded in
+// parallel. Only the blocks which hold the range are decoded.
+void
+decompress_blocks(const std::uint8_t* data,std::size_t size,
+		  output_buffer& result,bool verbose,int threads,
+		  text_range range)
+{
+  block_index index;
+  index.read(data,size);
+  auto len=index.original_size();
+  auto offset=std::min(range.offset,len);
+  auto count=std::min(range.count,len-offset);
+  auto bsize=index.block_bytes();
+  std::size_t first=offset/bsize;
+  std::size_t last= count ? (offset+count+bsize-1)/bsize : first;
+  index.check(first,last);
+  auto out=result.allocate(count);
+  parallel_for(last-first,threads,[&](std::size_t i) {
+      block_decoder coder;
+      std::vector<std::uint8_t> scratch;
+      index.decode(first+i,offset,count,out,coder,scratch);
+    });
 
+  if (verbose)
+    std::cerr<<last-first<<" of "<<index.blocks()<<" blocks of "
+	     <<bsize<<" bytes"<<std::endl;
+}
+
+void
+decompress_memory(const std::uint8_t* data,std::size_t size,
+		  output_buffer& result,bool verbose,int threads,
+		  text_range range=text_range())
+{
+  mem_reader in(data,size);
   
-  std::ofstream of;
-  of.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-  of.open(file_out);
+  auto magic=in.get<std::array<char,2>>();
+  if (magic[0]!='H' || (magic[1]!='M' && magic[1]!='C'))
+    throw std::logic_error("No magic number in the source file");
   
-  char_writer f(of,original_len);
+  auto version= magic[1]=='C' ? in.get<char>() : 0;
+  if (version<2 && !range.whole())
+    throw std::logic_error("Range extraction needs a block container");
+  if (magic[1]=='M')
+    decompress_legacy(in,result,verbose);
+  else if (version==1)
+    decompress_single(in,result,verbose);
+  else if (version==2 || version==3)
+    decompress_blocks(data,size,result,verbose,threads,range);
+  else
+    throw std::logic_error("Unsupported format version");
+}
 
-  symbols.decode(txt,f,padding);
+// Decodes version 2 and 3 frames as they come, up to threads blocks
+// at once, and ignores the index. Memory is bounded by a few blocks.
+void
+decompress_stream(std::istream& in,std::ostream& of,int threads,
+		  char version)
+{
+  std::uint32_t bsize=0;
+  if (read_some(in,&bsize,sizeof(bsize))!=sizeof(bsize) || bsize==0)
+    throw std::logic_error("Invalid block size");
+  
+  struct frame {
+    std::uint32_t raw_len;
+    std::uint32_t checksum;
+    std::vector<std::uint8_t> body;
+    std::vector<std::uint8_t> text;
+    block_decoder coder;
+  };
+  std::vector<frame> batch(threads);
+  const std::size_t hdr_len=frame_header_len(version);
+  bool end=false;
+  for(std::size_t done=0;!end;) {
+    std::size_t n=0;
+    while (n<batch.size()) {
+      std::uint32_t hdr[3];
+      if (read_some(in,hdr,hdr_len)!=hdr_len)
+	throw std::logic_error("Unexpected end of compressed data");
+      if (hdr[0]==0) {
+	end=true;
+	break;
+      }
+      if (hdr[0]>bsize || hdr[1]>2*bsize+1024)
+	throw std::logic_error("Invalid block length");
+      auto& f=batch[n++];
+      f.raw_len=hdr[0];
+      f.checksum=hdr[2];
+      f.body.resize(hdr[1]);
+      if (read_some(in,f.body.data(),hdr[1])!=hdr[1])
+	throw std::logic_error("Unexpected end of compressed data");
+    }
+    parallel_for(n,threads,[&](std::size_t i) {
+	auto& f=batch[i];
+	if (version>=3 &&
+	    f.checksum!=frame_checksum(f.raw_len,f.body.size(),f.body.data())) {
+	  throw std::logic_error("Block "+std::to_string(done+i)+
+				 " is corrupted: checksum mismatch");
+	}
+	f.text.resize(f.raw_len);
+	f.coder.decode(f.body.data(),f.body.size(),f.text.data(),f.raw_len);
+      });
+    for(std::size_t i=0;i<n;++i) {
+      of.write(reinterpret_cast<char*>(batch[i].text.data()),
+	       batch[i].raw_len);
+    }
+    done += n;
+  }
+  of.flush();
+}
 
+// A range of the text is extracted through the block index, so the
+// whole input is needed even from a pipe.
+void
+decompress(const std::string& file_in, const std::string& file_out, 
+	   bool verbose, int threads, text_range range=text_range())
+{
+  output_buffer result(file_out);
+  if (is_regular(file_in)) {
+    mapped_file src;
+    src.open(file_in);
+    decompress_memory(src.data(),src.size(),result,verbose,threads,range);
+    result.commit();
+    return;
+  }
+  
+  // A pipe: block containers are decoded frame by frame, other
+  // formats need the whole input.
+  std::ifstream fin;
+  auto& in=open_input(file_in,fin);
+  char magic[3];
+  if (read_some(in,magic,sizeof(magic))==sizeof(magic) &&
+      magic[0]=='H' && magic[1]=='C' && (magic[2]==2 || magic[2]==3) &&
+      range.whole()) {
+    std::ofstream fout;
+    decompress_stream(in,open_output(file_out,fout),threads,magic[2]);
+    return;
+  }
+  std::string txt(magic,in.gcount());
+  txt.append(std::istreambuf_iterator<char>(in),
+	     std::istreambuf_iterator<char>());
+  decompress_memory(reinterpret_cast<const std::uint8_t*>(txt.data()),
+		    txt.size(),result,verbose,threads,range);
+  result.commit();
 }
 
 
+// Codes batches of up to threads blocks given by read(max,batch),
+// which returns the number of bytes and sets batch to them. A short
+// batch is the last one. Frames are written as soon as they are coded,
+// the index and the trailer go at the end.
+template<typename READ>
+void
+compress_blocks(READ read,std::ostream& of,bool verbose,int threads,
+		bool interleaved)
+{
+  std::vector<std::uint8_t> header;
+  put(header,std::array<char,3>{'H','C',format_version});
+  put(header,block_size);
+  of.write(reinterpret_cast<char*>(&header[0]),header.size());
+  std::uint64_t written=header.size();
+
+  const std::size_t batch_size=static_cast<std::size_t>(threads)*block_size;
+  std::vector<std::vector<std::uint8_t>> bodies(threads);
+  std::vector<block_encoder> coders(threads);
+  std::vector<std::uint32_t> checksums(threads);
+  std::vector<std::uint64_t> index;
+  std::uint64_t len=0;
+  for(bool more=true;more;) {
+    const std::uint8_t* batch=nullptr;
+    std::size_t got=read(batch_size,batch);
+    more = got==batch_size;
+    std::size_t nblocks=(got+block_size-1)/block_size;
+    parallel_for(nblocks,threads,[&](std::size_t i) {
+	auto at=i*block_size;
+	std::uint32_t raw_len=std::min<std::size_t>(block_size,got-at);
+	coders[i].encode(batch+at,raw_len,bodies[i],interleaved);
+	checksums[i]=frame_checksum(raw_len,bodies[i].size(),
+				    bodies[i].data());
+      });
+    
+    for(std::size_t i=0;i<nblocks;++i) {
+      std::uint32_t hdr[3]={
+	static_cast<std::uint32_t>(std::min<std::size_t>(block_size,
+							 got-i*block_size)),
+	static_cast<std::uint32_t>(bodies[i].size()),checksums[i]};
+      if (verbose)
+	std::cerr<<"block "<<index.size()<<": "<<hdr[0]<<" -> "<<hdr[1]
+		 <<std::endl;
+      index.push_back(written);
+      of.write(reinterpret_cast<char*>(hdr),sizeof(hdr));
+      of.write(reinterpret_cast<char*>(bodies[i].data()),hdr[1]);
+      written += sizeof(hdr)+hdr[1];
+    }
+    len += got;
+  }
+
+  std::uint32_t end[3]={0,0,0};
+  of.write(reinterpret_cast<char*>(end),sizeof(end));
+  std::uint64_t index_pos=written+sizeof(end);
+  std::uint64_t trailer[2]={index_pos,len};
+  auto checksum=crc32c(reinterpret_cast<std::uint8_t*>(index.data()),
+		       index.size()*sizeof(index[0]));
+  checksum=crc32c(reinterpret_cast<std::uint8_t*>(trailer),sizeof(trailer),
+		  checksum);
+  if (!index.empty())
+    of.write(reinterpret_cast<char*>(&index[0]),
+	     index.size()*sizeof(index[0]));
+  of.write(reinterpret_cast<char*>(trailer),sizeof(trailer));
+  of.write(reinterpret_cast<char*>(&checksum),sizeof(checksum));
+  of.flush();
+}
 
+// Reads the input by threads blocks at once, so it works on pipes with
+// memory bounded by a few blocks. A regular file is mapped and coded
+// in place.
 void
 compress(const std::string& file_in, const std::string& file_out,
-	 bool verbose)
+	 bool verbose, int threads, bool interleaved)
 {
-   
-  std::string txt=read_file(file_in);
-  auto freq = count_frequence(txt);
-  
-  trie symbols;
-  
-  symbols.from_frequences(freq);
-  
-  auto tbl = symbols.to_map();
-  
-  auto saved_tbl = save_table(tbl);
-  int sz=saved_tbl.size()*sizeof(prefix);
+  std::ofstream fout;
+  if (is_regular(file_in)) {
+    mapped_file src;
+    src.open(file_in);
+    std::size_t pos=0;
+    compress_blocks([&](std::size_t max,const std::uint8_t*& batch) {
+	batch=src.data()+pos;
+	auto got=std::min(max,src.size()-pos);
+	pos += got;
+	return got;
+      },open_output(file_out,fout),verbose,threads,interleaved);
+  } else {
+    std::ifstream fin;
+    auto& in=open_input(file_in,fin);
+    std::vector<std::uint8_t> buf;
+    compress_blocks([&](std::size_t max,const std::uint8_t*& batch) {
+	buf.resize(max);
+	batch=buf.data();
+	return read_some(in,buf.data(),max);
+      },open_output(file_out,fout),verbose,threads,interleaved);
+  }
+}
 
-  if (verbose)
-    show_table(saved_tbl);
-  
-  std::ofstream of;
-  of.exceptions ( std::ifstream::failbit | std::ifstream::badbit );
-  of.open(file_out);
-  
-  const char magic[]={'H','M'};
-  of.write(magic,sizeof(magic));
-
-  std::streamoff len=txt.size();
-  of.write(reinterpret_cast<char*>(&len),sizeof(len));
-
-  of.write(reinterpret_cast<char*>(&sz),sizeof(sz));
-  auto padding_pos = of.tellp();
-  std::uint16_t padding=0;
-  of.write(reinterpret_cast<char*>(&padding),sizeof(padding));
-  if (sz)
-    of.write(reinterpret_cast<char*>(&saved_tbl[0]),sz);
-  
-  bin_writer bin(of);
-  for(auto c: txt) {
-    auto it=tbl.find(c);
-    if (it!=tbl.end()) {
-      bin.write(it->second);
+
+// Synthetic corpora for the benchmark. Generators are seeded, so runs
+// are comparable.
+std::vector<std::uint8_t>
+make_corpus(const std::string& kind,std::size_t size)
+{
+  std::mt19937_64 rnd(12345);
+  std::vector<std::uint8_t> data(size);
+  if (kind=="uniform") {
+    for(auto& c: data)
+      c=rnd();
+  } else if (kind=="skewed") {
+    std::geometric_distribution<int> dist(0.05);
+    for(auto& c: data)
+      c=std::min(dist(rnd),255);
+  } else if (kind=="fibonacci") {
+    // Symbol k is fib(k) times more frequent than the rarest one,
+    // plain Huffman codes would be as long as the alphabet.
+    std::vector<double> weights;
+    double a=1,b=1;
+    for(int k=0;k<40;++k) {
+      weights.push_back(a);
+      std::swap(a,b);
+      b += a;
     }
+    std::discrete_distribution<int> dist(weights.begin(),weights.end());
+    for(auto& c: data)
+      c='0'+dist(rnd);
+  } else if (kind=="text") {
+    std::vector<std::string> words;
+    std::uniform_int_distribution<int> letter('a','z'),wlen(1,10);
+    for(int w=0;w<5000;++w) {
+      std::string word(wlen(rnd),' ');
+      for(auto& c: word)
+	c=letter(rnd);
+      words.push_back(word);
+    }
+    std::vector<double> zipf;
+    for(std::size_t w=0;w<words.size();++w)
+      zipf.push_back(1.0/(w+1));
+    std::discrete_distribution<std::size_t> pick(zipf.begin(),zipf.end());
+    std::uniform_int_distribution<int> line(0,11);
+    for(std::size_t i=0;i<size;) {
+      const std::string& w=words[pick(rnd)];
+      for(std::size_t k=0;k<w.size() && i<size;++k)
+	data[i++]=w[k];
+      if (i<size)
+	data[i++]= line(rnd) ? ' ' : '\n';
+    }
+  } else if (kind=="binary") {
+    // Records of a counter, a small signed delta and a flags byte.
+    std::normal_distribution<double> delta(0,300);
+    std::uint32_t counter=0;
+    for(std::size_t i=0;i+16<=size;i+=16) {
+      std::int32_t d=delta(rnd);
+      counter += 1+(rnd()&7);
+      std::uint64_t flags=rnd()&0x0101;
+      std::memcpy(&data[i],&counter,sizeof(counter));
+      std::memcpy(&data[i+4],&d,sizeof(d));
+      std::memcpy(&data[i+8],&flags,sizeof(flags));
+    }
+  } else {
+    throw std::logic_error("Unknown corpus "+kind);
   }
-  padding=bin.write_tail();
-  if (padding!=0) {
-    of.seekp(padding_pos);
-    of.write(reinterpret_cast<char*>(&padding),sizeof(padding));
+  return data;
+}
+
+// Bytes of the container which are not code bits: file header, frame
+// headers, code tables, stream sizes, the index and the trailer.
+std::size_t
+container_overhead(const std::string& packed)
+{
+  auto data=reinterpret_cast<const std::uint8_t*>(packed.data());
+  mem_reader in(data,packed.size());
+  std::size_t overhead=packed.size();
+  in.skip(3+sizeof(std::uint32_t));
+  for(;;) {
+    auto raw_len=in.get<std::uint32_t>();
+    auto body_len=in.get<std::uint32_t>();
+    in.skip(frame_header_len(format_version)-2*sizeof(std::uint32_t));
+    if (!raw_len)
+      break;
+    mem_reader body(in.skip(body_len),body_len);
+    auto type=body.get<block_type>();
+    if (type!=stored_block)
+      body.skip(body.get<std::uint16_t>());
+    if (type==context_block || type==context4_block) {
+      auto bitmap=body.get<std::array<std::uint8_t,32>>();
+      for(int p=0;p<256;++p) {
+	if ((bitmap[p/8]>>(p%8))&1)
+	  body.skip(body.get<std::uint16_t>());
+      }
+    }
+    if (type==huffman4_block || type==context4_block)
+      body.skip(3*sizeof(std::uint32_t));
+    overhead -= body.left();
   }
+  return overhead;
+}
+
+// Runs compression and decompression in memory over the synthetic
+// corpora and checks that the round-trip gives the same bytes.
+bool
+benchmark(std::size_t size,int threads)
+{
+  using clock=std::chrono::steady_clock;
+  const int runs=3;
+  bool ok=true;
+  std::cout<<std::left<<std::setw(10)<<"corpus"<<std::setw(8)<<"streams"
+	   <<std::right<<std::setw(10)<<"bits/sym"<<std::setw(10)<<"overhead"
+	   <<std::setw(12)<<"comp MB/s"<<std::setw(12)<<"decomp MB/s"
+	   <<std::endl;
+  for(auto kind: {"uniform","skewed","fibonacci","text","binary"}) {
+    auto txt=make_corpus(kind,size);
+    for(bool interleaved: {false,true}) {
+      double comp=1e100,decomp=1e100;
+      std::string packed;
+      for(int r=0;r<runs;++r) {
+	std::ostringstream of;
+	auto start=clock::now();
+	std::size_t pos=0;
+	compress_blocks([&](std::size_t max,const std::uint8_t*& batch) {
+	    batch=txt.data()+pos;
+	    auto got=std::min(max,txt.size()-pos);
+	    pos += got;
+	    return got;
+	  },of,false,threads,interleaved);
+	comp=std::min(comp,std::chrono::duration<double>(clock::now()-
+							 start).count());
+	packed=of.str();
+
+	output_buffer result;
+	start=clock::now();
+	decompress_memory(reinterpret_cast<const std::uint8_t*>(packed.data()),
+			  packed.size(),result,false,threads);
+	decomp=std::min(decomp,std::chrono::duration<double>(clock::now()-
+							     start).count());
+	if (result.data()!=txt) {
+	  std::cout<<kind<<": round-trip FAILED"<<std::endl;
+	  ok=false;
+	}
+      }
+      double mb=size/1e6;
+      std::cout<<std::left<<std::setw(10)<<kind<<std::setw(8)
+	       <<(interleaved ? 4 : 1)<<std::right<<std::fixed
+	       <<std::setprecision(3)<<std::setw(10)
+	       <<8.0*packed.size()/size<<std::setw(10)
+	       <<container_overhead(packed)<<std::setprecision(1)
+	       <<std::setw(12)<<mb/comp<<std::setw(12)<<mb/decomp<<std::endl;
+    }
+  }
+  return ok;
 }
 
 void
 usage(const char* prog)
 {
-  std::cerr<<"Usage: "<<prog<<" [-d|-c] infile outfile"<<std::endl; 
+  std::cerr<<"Usage: "<<prog<<" [-j threads] [-4] [-r offset[:length]] "
+	   <<"[-d|-c] infile outfile"<<std::endl
+	   <<"       "<<prog<<" [-j threads] -b [megabytes]"<<std::endl
+	   <<"  -4 codes every block as four interleaved streams"<<std::endl
+	   <<"  -r decodes only the given bytes of the text"<<std::endl
+	   <<"  -b runs the benchmark over synthetic corpora"<<std::endl
+	   <<"  \"-\" as a file name stands for stdin or stdout"<<std::endl; 
 }
 
 int
 main(int ac, char* av[])
 {
+  std::ios::sync_with_stdio(false);
   try {
-    if (ac==4) {
-      if (std::string(av[1])=="-c")
-	compress(av[2],av[3],false);
-      else if (std::string(av[1])=="-d")
-	decompress(av[2],av[3],false);
+    int threads=std::max(1u,std::thread::hardware_concurrency());
+    bool interleaved=false;
+    text_range range;
+    int arg=1;
+    for(;arg<ac;++arg) {
+      std::string opt(av[arg]);
+      if (opt=="-b") {
+	std::size_t mb= arg+1<ac ? std::stoul(av[arg+1]) : 32;
+	exit(benchmark(mb<<20,threads) ? 0 : 1);
+      }
+      if (arg>=ac-3)
+	break;
+      if (opt=="-j") {
+	threads=std::stoi(av[++arg]);
+	if (threads<1) {
+	  usage(av[0]);
+	  exit(1);
+	}
+      } else if (opt=="-4") {
+	interleaved=true;
+      } else if (opt=="-r") {
+	std::string r(av[++arg]);
+	auto colon=r.find(':');
+	range.offset=std::stoull(r.substr(0,colon));
+	if (colon!=std::string::npos)
+	  range.count=std::stoull(r.substr(colon+1));
+      } else {
+	usage(av[0]);
+	exit(1);
+      }
+    }
+    if (ac-arg==3) {
+      if (std::string(av[arg])=="-c")
+	compress(av[arg+1],av[arg+2],false,threads,interleaved);
+      else if (std::string(av[arg])=="-d")
+	decompress(av[arg+1],av[arg+2],false,threads,range);
       else {
 	usage(av[0]);
 	exit(1);
@@ -570,4 +2069,5 @@ main(int ac, char* av[])
     exit(1);
   }
   exit(0);
-} 
+}
+#endif